@@ -0,0 +1,89 @@
+#ifndef ARCHIVE_EVENT_H
+#define ARCHIVE_EVENT_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <cstdint>
+#include <cstdio>
+
+namespace spdlog {
+namespace sinks {
+
+// A finished archive, passed to compressed_rotating_sink_options::archive_callback.
+struct archive_event {
+  filename_t filename;  // e.g. "logs/log.3.txt.<stamp>.gz"
+  std::size_t number = 0;
+  std::uint64_t bytes_in = 0;   // uncompressed, 0 when not known
+  std::uint64_t bytes_out = 0;  // of the archive
+  // time of the first and last record, the epoch when not known (e.g. a file left
+  // over from an earlier run)
+  log_clock::time_point first_time;
+  log_clock::time_point last_time;
+  log_clock::time_point rotation_time;  // the stamp in the name
+  std::uint32_t crc32c = 0;             // of the archive file, as S3 and GCS take it
+};
+
+}  // namespace sinks
+
+namespace details {
+
+// CRC-32C (Castagnoli), 8 bytes at a time
+struct crc32c_table {
+  std::uint32_t t[8][256];
+  crc32c_table() {
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      std::uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1u)));
+      }
+      t[0][i] = c;
+    }
+    for (int s = 1; s < 8; ++s) {
+      for (int i = 0; i < 256; ++i) {
+        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+// crc of the bytes before data, 0 to start
+inline std::uint32_t crc32c(std::uint32_t crc, const void* data, std::size_t size) {
+  static const crc32c_table table;
+  const auto& t = table.t;
+  auto p = static_cast<const unsigned char*>(data);
+  crc = ~crc;
+  while (size >= 8) {
+    std::uint32_t lo = crc ^ (p[0] | static_cast<std::uint32_t>(p[1]) << 8 | static_cast<std::uint32_t>(p[2]) << 16 | static_cast<std::uint32_t>(p[3]) << 24);
+    std::uint32_t hi = p[4] | static_cast<std::uint32_t>(p[5]) << 8 | static_cast<std::uint32_t>(p[6]) << 16 | static_cast<std::uint32_t>(p[7]) << 24;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    p += 8;
+    size -= 8;
+  }
+  while (size-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return ~crc;
+}
+
+// reads the file through once, false if it can not be read
+inline bool file_crc32c(const filename_t& filename, std::uint32_t& crc) {
+  std::FILE* in = nullptr;
+  if (os::fopen_s(&in, filename, SPDLOG_FILENAME_T("rb"))) {
+    return false;
+  }
+  crc = 0;
+  char buf[64 * 1024];
+  std::size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), in)) > 0) {
+    crc = crc32c(crc, buf, n);
+  }
+  bool ok = std::ferror(in) == 0;
+  std::fclose(in);
+  return ok;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef ARCHIVE_INDEX_H
+#define ARCHIVE_INDEX_H
+
+#include <spdlog/common.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "SinkDirectory.h"
+
+namespace spdlog {
+namespace details {
+
+//
+// Time part of the archive names, ".<epoch microseconds>" of the rotation.
+// next() moves it past the previous stamp of the process, so tails stay unique
+// even for rotations in the same microsecond. Rotations pass the number around
+// and format it where a name is built; scan() parses it once for each archive.
+//
+struct archive_stamp {
+  std::uint64_t micros = 0;  // 0 for archives named otherwise (older versions)
+
+  static archive_stamp next(log_clock::time_point now = log_clock::now());
+  log_clock::time_point time() const { return log_clock::time_point(std::chrono::duration_cast<log_clock::duration>(std::chrono::microseconds(micros))); }
+  // ".<micros>"
+  filename_t suffix() const;
+  // from the start of a tail, ".<micros>.txt.gz" or ".<micros>.gz". micros 0 if not a stamp
+  static archive_stamp parse(const filename_t& tail);
+  // name from pos is exactly suffix(), as in the staged "log.txt.<micros>". micros 0 if not
+  static archive_stamp parse_suffix(const filename_t& name, std::size_t pos);
+};
+
+inline archive_stamp archive_stamp::next(log_clock::time_point now) {
+  static std::atomic<std::uint64_t> last{0};
+  auto micros = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count());
+  std::uint64_t prev = last.load(std::memory_order_relaxed);
+  do {
+    micros = std::max(micros, prev + 1);
+  } while (!last.compare_exchange_weak(prev, micros, std::memory_order_relaxed));
+  archive_stamp stamp;
+  stamp.micros = micros;
+  return stamp;
+}
+
+inline filename_t archive_stamp::suffix() const {
+  char buf[24];  // "." and 20 digits
+  auto result = fmt::format_to_n(buf, sizeof(buf), ".{}", micros);
+  return filename_t(buf, result.out);
+}
+
+inline archive_stamp archive_stamp::parse(const filename_t& tail) {
+  archive_stamp stamp;
+  std::size_t pos = 1;
+  if (tail.size() < 2 || tail[0] != '.') {
+    return stamp;
+  }
+  std::uint64_t micros = 0;
+  while (pos < tail.size() && tail[pos] >= '0' && tail[pos] <= '9' && pos <= 20) {
+    micros = micros * 10 + static_cast<std::uint64_t>(tail[pos] - '0');
+    ++pos;
+  }
+  if (pos > 1 && pos < tail.size() && tail[pos] == '.') {
+    stamp.micros = micros;
+  }
+  return stamp;
+}
+
+inline archive_stamp archive_stamp::parse_suffix(const filename_t& name, std::size_t pos) {
+  archive_stamp stamp;
+  if (pos + 2 > name.size() || name.size() - pos > 21 || name[pos] != '.') {
+    return stamp;
+  }
+  std::uint64_t micros = 0;
+  for (std::size_t i = pos + 1; i < name.size(); ++i) {
+    if (name[i] < '0' || name[i] > '9') {
+      return stamp;
+    }
+    micros = micros * 10 + static_cast<std::uint64_t>(name[i] - '0');
+  }
+  stamp.micros = micros;
+  return stamp;
+}
+
+// an archive of the index: the part of its name after the number, and its stamp
+struct archive_entry {
+  filename_t tail;
+  archive_stamp stamp;
+};
+
+// a file set aside by a rotation or a failed archive and not archived yet, listed by scan()
+struct staged_file {
+  filename_t filename;  // with the directory
+  archive_stamp stamp;
+};
+
+//
+// In-memory list of the compressed archives of one sink.
+// Archives are named <dir>/<basename>.<number><ext><tail>, where tail ends
+// with the compressed file extension, e.g. "logs/log.3.txt.<time>.gz".
+// Rotated files not compressed yet ("logs/log.3.txt") are listed in raw(), files
+// set aside and never archived ("logs/log.txt.<time>", "logs/log.txt.gz.<time>",
+// "logs/log.3.txt.<time>") in staged(), oldest first. Numbers have at most 12
+// digits: without ext, the staged "log.<time>" would be taken for a rotated file.
+// The directory is listed once by scan(); afterwards the owner keeps the
+// index up to date as it creates, renames and deletes archives.
+//
+class archive_index {
+ public:
+  using entries_t = std::multimap<std::size_t, archive_entry>;
+  using raw_t = std::set<std::size_t>;
+  using staged_t = std::vector<staged_file>;
+
+  archive_index() = default;
+  archive_index(const filename_t& dir, const filename_t& basename, filename_t ext, filename_t comp_ext);
+
+  // dir is the directory of the archives, held open by the owner
+  void scan(const sink_directory& dir);
+
+  // non-regex matcher for "<basename>.<number><ext><tail>", filename without directory.
+  bool match(const filename_t& filename, std::size_t& number, filename_t& tail) const;
+  // matcher for "<basename>.<number><ext>"
+  bool match_raw(const filename_t& filename, std::size_t& number) const;
+  // matcher for "<basename><ext><stamp>", "<basename><ext><comp_ext><stamp>" and "<basename>.<number><ext><stamp>"
+  bool match_staged(const filename_t& filename, archive_stamp& stamp) const;
+  filename_t path(std::size_t number, const filename_t& tail) const;
+
+  // highest number in use, raw or compressed. 0 if none.
+  std::size_t last_number() const;
+
+  entries_t& entries() { return entries_; }
+  const entries_t& entries() const { return entries_; }
+  raw_t& raw() { return raw_; }
+  const raw_t& raw() const { return raw_; }
+  staged_t& staged() { return staged_; }
+  const staged_t& staged() const { return staged_; }
+
+ private:
+  // longer numbers are stamps, epoch microseconds have 16 digits
+  static constexpr std::size_t max_number_digits = 12;
+
+  // parses "<prefix><number><ext>" at the start of filename, returns the position after ext or 0
+  std::size_t parse_number_(const filename_t& filename, std::size_t& number) const;
+
+  filename_t dir_;
+  filename_t prefix_;     // "<basename>."
+  filename_t dir_prefix_;   // "<dir>/"
+  filename_t path_prefix_;  // "<dir>/<basename>."
+  filename_t active_;     // "<basename><ext>"
+  filename_t ext_;
+  filename_t comp_ext_;
+  entries_t entries_;
+  raw_t raw_;
+  staged_t staged_;
+};
+
+inline archive_index::archive_index(const filename_t& dir, const filename_t& basename, filename_t ext, filename_t comp_ext)
+    : dir_(dir.empty() ? "./" : dir), prefix_(basename + "."), active_(basename + ext), ext_(std::move(ext)), comp_ext_(std::move(comp_ext)) {
+  dir_prefix_ = dir.empty() ? filename_t("./") : dir + "/";
+  path_prefix_ = dir_prefix_ + prefix_;
+}
+
+inline void archive_index::scan(const sink_directory& dir) {
+  entries_.clear();
+  raw_.clear();
+  staged_.clear();
+  std::size_t number;
+  filename_t tail;
+  archive_stamp stamp;
+  bool listed = dir.list([&](const char* name) {
+    if (std::strncmp(name, prefix_.c_str(), prefix_.size()) != 0) {
+      return;  // unrelated files cost no string
+    }
+    filename_t filename(name);
+    if (match(filename, number, tail)) {
+      archive_stamp archived = archive_stamp::parse(tail);
+      entries_.emplace(number, archive_entry{std::move(tail), archived});
+    } else if (match_raw(filename, number)) {
+      raw_.insert(number);
+    } else if (match_staged(filename, stamp)) {
+      staged_.push_back(staged_file{dir_prefix_ + filename, stamp});
+    }
+  });
+  if (!listed) {
+    SPDLOG_THROW(spdlog_ex("archive_index: failed listing " + os::filename_to_str(dir_), errno));
+  }
+  std::sort(staged_.begin(), staged_.end(), [](const staged_file& a, const staged_file& b) { return a.stamp.micros < b.stamp.micros; });
+}
+
+inline std::size_t archive_index::parse_number_(const filename_t& filename, std::size_t& number) const {
+  if (filename.size() < prefix_.size() + 1 + ext_.size() || filename.compare(0, prefix_.size(), prefix_) != 0) {
+    return 0;
+  }
+
+  std::size_t pos = prefix_.size();
+  number = 0;
+  while (pos < filename.size() && filename[pos] >= '0' && filename[pos] <= '9') {
+    number = number * 10 + static_cast<std::size_t>(filename[pos] - '0');
+    ++pos;
+  }
+  if (pos == prefix_.size() || pos - prefix_.size() > max_number_digits || filename.compare(pos, ext_.size(), ext_) != 0) {
+    return 0;
+  }
+  return pos + ext_.size();
+}
+
+inline bool archive_index::match(const filename_t& filename, std::size_t& number, filename_t& tail) const {
+  std::size_t pos = parse_number_(filename, number);
+  if (pos == 0 || filename.size() - pos < comp_ext_.size() || filename.compare(filename.size() - comp_ext_.size(), comp_ext_.size(), comp_ext_) != 0) {
+    return false;
+  }
+  tail = filename.substr(pos);
+  return !tail.empty();
+}
+
+inline bool archive_index::match_raw(const filename_t& filename, std::size_t& number) const {
+  std::size_t pos = parse_number_(filename, number);
+  return pos != 0 && pos == filename.size();
+}
+
+inline bool archive_index::match_staged(const filename_t& filename, archive_stamp& stamp) const {
+  std::size_t number;
+  std::size_t pos = parse_number_(filename, number);
+  if (pos == 0) {
+    if (filename.compare(0, active_.size(), active_) != 0) {
+      return false;
+    }
+    pos = active_.size();
+    if (!comp_ext_.empty() && filename.compare(pos, comp_ext_.size(), comp_ext_) == 0) {
+      pos += comp_ext_.size();
+    }
+  }
+  stamp = archive_stamp::parse_suffix(filename, pos);
+  return stamp.micros != 0;
+}
+
+inline filename_t archive_index::path(std::size_t number, const filename_t& tail) const {
+  return fmt::format(SPDLOG_FILENAME_T("{}{}{}{}"), path_prefix_, number, ext_, tail);
+}
+
+inline std::size_t archive_index::last_number() const {
+  std::size_t last = raw_.empty() ? 0 : *raw_.rbegin();
+  if (!entries_.empty()) {
+    last = std::max(last, entries_.rbegin()->first);
+  }
+  return last;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef BINARY_RECORD_H
+#define BINARY_RECORD_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/log_msg.h>
+#include <spdlog/formatter.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace spdlog {
+namespace details {
+
+//
+// Binary encoding of a log_msg, written in place of the formatted text. A record is
+//   0xB1, u32 little endian size of the rest, then
+//   varint nanoseconds since the epoch, u8 level, varint thread id,
+//   varint sequence (0 when none, see compressed_rotating_file_sink_sharded),
+//   varint size + logger name, varint size + source file name,
+//   varint line + varint size + function name (only with a source file),
+//   and the payload up to the end of the record.
+// Records carry no state from one to the next, so a file, a seek frame or what is
+// left after a cut can be decoded from any record boundary.
+//
+constexpr unsigned char binary_record_magic = 0xB1;
+constexpr std::size_t binary_record_header = 5;
+
+// a decoded record, pointing into the decoded bytes
+struct binary_record {
+  log_clock::time_point time;
+  level::level_enum level = level::off;
+  std::size_t thread_id = 0;
+  std::uint64_t sequence = 0;
+  string_view_t logger_name;
+  string_view_t source_file;  // empty when none
+  int source_line = 0;
+  string_view_t source_function;
+  string_view_t payload;
+};
+
+// writes value at p, at most 10 bytes
+inline char* put_varint(char* p, std::uint64_t value) {
+  while (value >= 0x80) {
+    *p++ = static_cast<char>(static_cast<unsigned char>(value) | 0x80);
+    value >>= 7;
+  }
+  *p++ = static_cast<char>(value);
+  return p;
+}
+
+// the fixed fields go through one buffer, the strings are appended as they are
+inline void encode_binary_record(const log_msg& msg, memory_buf_t& dest, std::uint64_t sequence = 0) {
+  std::size_t start = dest.size();
+  char head[binary_record_header + 4 * 10 + 1];
+  char* p = head + binary_record_header;
+  head[0] = static_cast<char>(binary_record_magic);
+  p = put_varint(p, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(msg.time.time_since_epoch()).count()));
+  *p++ = static_cast<char>(msg.level);
+  p = put_varint(p, msg.thread_id);
+  p = put_varint(p, sequence);
+  p = put_varint(p, msg.logger_name.size());
+  dest.append(head, p);
+  dest.append(msg.logger_name.data(), msg.logger_name.data() + msg.logger_name.size());
+  // keyed on the file name, the decoder reads line and function only after one
+  std::size_t file_size = msg.source.filename != nullptr ? std::strlen(msg.source.filename) : 0;
+  if (file_size == 0) {
+    char none = 0;
+    dest.append(&none, &none + 1);
+  } else {
+    std::size_t function_size = msg.source.funcname != nullptr ? std::strlen(msg.source.funcname) : 0;
+    p = put_varint(head, file_size);
+    dest.append(head, p);
+    dest.append(msg.source.filename, msg.source.filename + file_size);
+    p = put_varint(head, static_cast<std::uint64_t>(msg.source.line));
+    p = put_varint(p, function_size);
+    dest.append(head, p);
+    dest.append(msg.source.funcname, msg.source.funcname + function_size);
+  }
+  dest.append(msg.payload.data(), msg.payload.data() + msg.payload.size());
+  auto size = static_cast<std::uint32_t>(dest.size() - start - binary_record_header);
+  for (std::size_t i = 0; i < 4; ++i) {
+    dest.data()[start + 1 + i] = static_cast<char>(size >> (8 * i));
+  }
+}
+
+// size of the record starting at data: 0 if more bytes are needed to tell, -1 if it is not a record
+inline std::ptrdiff_t binary_record_size(const char* data, std::size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if (static_cast<unsigned char>(data[0]) != binary_record_magic) {
+    return -1;
+  }
+  if (size < binary_record_header) {
+    return 0;
+  }
+  std::uint32_t body = 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    body |= static_cast<std::uint32_t>(static_cast<unsigned char>(data[1 + i])) << (8 * i);
+  }
+  return static_cast<std::ptrdiff_t>(binary_record_header + body);
+}
+
+namespace binary_detail {
+
+inline bool read_varint(const char*& p, const char* end, std::uint64_t& value) {
+  value = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    auto byte = static_cast<unsigned char>(*p++);
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool read_bytes(const char*& p, const char* end, string_view_t& bytes) {
+  std::uint64_t size;
+  if (!read_varint(p, end, size) || size > static_cast<std::uint64_t>(end - p)) {
+    return false;
+  }
+  bytes = string_view_t(p, static_cast<std::size_t>(size));
+  p += size;
+  return true;
+}
+
+}  // namespace binary_detail
+
+// decodes the record starting at data, as binary_record_size() returns
+inline std::ptrdiff_t decode_binary_record(const char* data, std::size_t size, binary_record& record) {
+  using binary_detail::read_bytes;
+  using binary_detail::read_varint;
+  std::ptrdiff_t record_size = binary_record_size(data, size);
+  if (record_size <= 0 || static_cast<std::size_t>(record_size) > size) {
+    return record_size < 0 ? -1 : 0;
+  }
+  const char* p = data + binary_record_header;
+  const char* end = data + record_size;
+  std::uint64_t ns, thread_id, line;
+  if (!read_varint(p, end, ns) || p == end) {
+    return -1;
+  }
+  auto lvl = static_cast<unsigned char>(*p++);
+  if (lvl >= level::n_levels || !read_varint(p, end, thread_id) || !read_varint(p, end, record.sequence) || !read_bytes(p, end, record.logger_name) ||
+      !read_bytes(p, end, record.source_file)) {
+    return -1;
+  }
+  record.source_line = 0;
+  record.source_function = string_view_t();
+  if (record.source_file.size() > 0 && (!read_varint(p, end, line) || !read_bytes(p, end, record.source_function))) {
+    return -1;
+  }
+  record.time = log_clock::time_point(std::chrono::duration_cast<log_clock::duration>(std::chrono::nanoseconds(ns)));
+  record.level = static_cast<level::level_enum>(lvl);
+  record.thread_id = static_cast<std::size_t>(thread_id);
+  if (record.source_file.size() > 0) {
+    record.source_line = static_cast<int>(line);
+  }
+  record.payload = string_view_t(p, static_cast<std::size_t>(end - p));
+  return record_size;
+}
+
+// Writes encode_binary_record() instead of text, for any sink that takes a formatter.
+class binary_formatter final : public formatter {
+ public:
+  void format(const log_msg& msg, memory_buf_t& dest) override { encode_binary_record(msg, dest); }
+  std::unique_ptr<formatter> clone() const override { return std::unique_ptr<formatter>(new binary_formatter()); }
+};
+
+// truncate_partial_record() for binary records: walks the file from the start and cuts it
+// at the first record that is incomplete or not a record. Returns the bytes removed.
+inline std::size_t truncate_partial_binary_record(const filename_t& filename) {
+#ifndef _WIN32
+  int fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  off_t end = ::fstat(fd, &st) == 0 ? st.st_size : 0;
+  off_t keep = 0;
+  char buf[64 * 1024];
+  off_t buf_at = 0;
+  off_t buf_end = 0;  // buf holds [buf_at, buf_end) of the file
+  while (keep < end) {
+    if (buf_end - keep < static_cast<off_t>(binary_record_header) && buf_end < end) {
+      std::size_t want = static_cast<std::size_t>(std::min<off_t>(end - keep, static_cast<off_t>(sizeof(buf))));
+      ssize_t n = ::pread(fd, buf, want, keep);
+      if (n != static_cast<ssize_t>(want)) {
+        keep = end;  // unreadable, leave it alone
+        break;
+      }
+      buf_at = keep;
+      buf_end = keep + n;
+    }
+    std::ptrdiff_t record_size = binary_record_size(buf + (keep - buf_at), static_cast<std::size_t>(std::min(buf_end, end) - keep));
+    if (record_size <= 0 || record_size > end - keep) {
+      break;
+    }
+    keep += record_size;
+  }
+  if (keep < end && ::ftruncate(fd, keep) != 0) {
+    keep = end;
+  }
+  ::close(fd);
+  return static_cast<std::size_t>(end - keep);
+#else
+  (void)filename;
+  return 0;
+#endif
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
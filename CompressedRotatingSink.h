@@ -7,44 +7,392 @@
 #include <spdlog/sinks/base_sink.h>
 
 #include <algorithm>
-#include <boost/filesystem.hpp>
-#include <boost/algorithm/string/replace.hpp>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <cstdlib>
-#include <iostream>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <regex>
 #include <string>
-using namespace boost::filesystem;
-using namespace std;
+#include <thread>
+#include <type_traits>
+#include <vector>
 
+#include "ArchiveEvent.h"
+#include "ArchiveIndex.h"
+#include "BinaryRecord.h"
+#include "CompressionCodec.h"
+#include "CompressionWorker.h"
+#include "FileIoPolicy.h"
+#include "GroupCommit.h"
+#include "RetentionManager.h"
+#include "RotationPolicy.h"
+#include "SeekIndex.h"
+#include "SinkPolicy.h"
+#include "SinkStats.h"
 #include "shared.h"
 
 namespace spdlog {
+namespace details {
+
+// Utility::compressFile from shared.h, the codec used when none is configured.
+class utility_codec final : public compression_codec {
+ public:
+  filename_t extension() const override { return Utility::compressedFileExt; }
+  bool compress_file(const filename_t& src, const filename_t& target) const override {
+    // compressFile appends the extension itself
+    return Utility::compressFile(target.substr(0, target.size() - Utility::compressedFileExt.size()), src);
+  }
+};
+
+template <>
+struct policy_codec<compression_codec> {
+  static std::shared_ptr<compression_codec> make(const std::shared_ptr<compression_codec>& codec) { return codec ? codec : std::make_shared<utility_codec>(); }
+};
+
+}  // namespace details
+
 namespace sinks {
 
+// What to do with a rotated file when the compression queue is full.
+enum class compression_overflow_policy {
+  block,    // wait on the logging thread until the worker has room
+  discard,  // delete the rotated file instead of compressing it
+};
+
+// What to do with queued compressions when the sink is destroyed.
+enum class compression_shutdown_policy {
+  drain,    // compress everything still queued
+  abandon,  // skip queued jobs, their rotated files stay on disk uncompressed until the
+            // next sink on the same file archives them when it opens
+};
+
+// How rotated files and archives are named.
+enum class archive_naming {
+  // log.1.txt is the newest, every rotation renames all files up by one index
+  index,
+  // log.<seq>.txt with a sequence number that only grows. files are never renamed
+  // after rotation, retention deletes the lowest numbers.
+  sequence,
+};
+
+// What max_size is compared against when records are compressed as they are written.
+enum class size_accounting {
+  uncompressed,  // formatted bytes, rotation happens before the record that would exceed max_size
+  compressed,    // bytes that reached the file, rotation happens once max_size is reached.
+                 // lags behind the input by what the compressor holds back.
+};
+
+struct compressed_rotating_sink_options {
+  // compress rotated files on a background worker instead of the logging thread
+  bool async_compression = false;
+  // queue capacity of the worker created by the sink (ignored when one is supplied)
+  std::size_t compression_queue_size = 16;
+  compression_overflow_policy overflow_policy = compression_overflow_policy::block;
+  compression_shutdown_policy shutdown_policy = compression_shutdown_policy::drain;
+  // optional worker shared with other sinks
+  std::shared_ptr<details::compression_worker> worker;
+  archive_naming naming = archive_naming::index;
+
+  // Compression algorithm, Utility::compressFile when not set.
+  // e.g. std::make_shared<details::zstd_codec>(19) with COMPRESSED_SINK_USE_ZSTD.
+  // Archives a codec calls improvable() (details::adaptive_codec) are compressed again
+  // on the worker once nothing is queued, except with seekable archives or an
+  // archive_callback: those archives are handed out as they are written.
+  std::shared_ptr<details::compression_codec> codec;
+
+  // Compress each rotated file as independent chunks of compression_chunk_size bytes
+  // on this many threads, needs a codec with make_stream(). 0 or 1 compresses on the
+  // worker alone. compression_pool may be shared with other sinks instead.
+  std::size_t compression_threads = 0;
+  std::size_t compression_chunk_size = 4 * 1024 * 1024;
+  std::shared_ptr<details::compression_thread_pool> compression_pool;
+
+  // Streaming mode, needs a codec with make_stream(): records are compressed as
+  // they are written to log.txt<ext> and rotation only finishes the frame.
+  // There are no uncompressed rotated files, max_files is not used and archives
+  // are numbered from 1.
+  bool streaming = false;
+  size_accounting accounting = size_accounting::uncompressed;
+
+  // Batched writes: records are gathered into one block and written with a single
+  // call once it holds write_block_size bytes or its oldest record is write_block_age
+  // old (by log_msg::time). flush() writes it out as well. 0 writes every record.
+  std::size_t write_block_size = 0;
+  std::chrono::milliseconds write_block_age{0};
+
+  // Page cache behaviour of the active file. io_interval is the number of bytes
+  // between writeback calls, or the O_DIRECT buffer size, or the io_uring write size.
+  // io_uring keeps records in 4 buffers of io_interval bytes in the process until the
+  // kernel took them: a crash loses the buffer being filled, and possibly the writes in
+  // flight, up to 4 * io_interval (32 MB by default). A buffer is submitted part full
+  // by the first record logged io_max_age after its oldest one (0: only when full),
+  // so under a steady load the loss is about io_max_age of records; records that no
+  // other follows wait for flush(). Renames, unlinks and syncs stay synchronous.
+  write_io_policy io_policy = write_io_policy::buffered;
+  std::size_t io_interval = 8 * 1024 * 1024;
+  std::chrono::milliseconds io_max_age{100};
+
+  // Return from the constructor once the active file is open: the directory scan
+  // and the rotate_on_open compression (or a leftover stream) are finished on the
+  // worker, which implies async_compression. The first rotation waits for them.
+  bool lazy_open = false;
+
+  // Time based rotation on top of max_size, whichever comes first. For time
+  // only rotation pass SIZE_MAX as max_size.
+  rotation_clock rotation = rotation_clock::none;
+  std::chrono::seconds rotation_interval{3600};
+
+  // Seekable archives, needs a codec with make_stream(): archives are made of
+  // independent frames of about seek_frame_size uncompressed bytes, cut at record
+  // boundaries, and <archive>.idx maps each frame's uncompressed offset and time
+  // range to its compressed offset (see details::write_seek_index). 0 disables.
+  std::size_t seek_frame_size = 0;
+
+  // Byte budget and max age shared with other sinks, enforced over their archives
+  // together, oldest first, on top of max_comp_files. Uncompressed rotated files
+  // and seek indexes are not counted.
+  std::shared_ptr<details::retention_manager> retention;
+
+  // Called with a stats() snapshot after each rotation, on the logging thread under
+  // the sink's lock, and after each compression, on the thread that compressed.
+  std::function<void(const compressed_rotating_sink_stats&)> stats_callback;
+  // Called once for each finished archive, on the thread that compressed it, outside
+  // the sink's locks, so a shipper can pick it up without scanning the directory.
+  // event.filename is there until the callback returns: with index naming the next
+  // rotation renames it, and the retention manager only learns of it afterwards, so
+  // enforcement by another sink sharing it does not delete it meanwhile. Setting it makes the sink keep the time range of the active
+  // file, and read each archive back once for its crc32c.
+  std::function<void(const archive_event&)> archive_callback;
+  // time every write to the active file into stats().writes, reads the clock per write
+  bool write_latency_stats = false;
+
+  // Failed renames and compressions. The logging thread never waits: when the active
+  // file can not be renamed it keeps appending to it, and rotates at the first record
+  // after a backoff that starts at retry_backoff and doubles up to retry_backoff_max.
+  // An archive that fails waits aside and is tried again after the same backoff, by a
+  // delayed job on the worker, which goes on with other jobs meanwhile, or at a later
+  // rotation without one; newer archives of the sink wait behind it. After
+  // retry_attempts tries, or beyond compression_queue_size waiting, it is left on disk
+  // for the next open to archive.
+  std::size_t retry_attempts = 6;
+  std::chrono::milliseconds retry_backoff{10};
+  std::chrono::milliseconds retry_backoff_max{1000};
+
+  // Keep the next active file created ahead as log.txt.next, on the worker when there
+  // is one, with max_size bytes preallocated (fallocate, keeping its size at 0).
+  // Rotation then renames the active file while it is open, gives log.txt.next its
+  // name and swaps the descriptors; the old one is trimmed and closed on the worker.
+  // POSIX only, ignored elsewhere.
+  bool preallocate_files = false;
+
+  // Group commit: a thread fdatasyncs the active file every commit_interval, or once
+  // commit_bytes were logged since the last sync, and a record is durable when a sync
+  // after it finished; wait_durable() blocks until then. Rotated files are synced,
+  // with their directory, before the records in them count as durable. On open the
+  // active file is cut back to its last complete record, the rest of one a crash
+  // interrupted (not in streaming mode, where each commit flushes the stream).
+  // Needs a sink with a mutex (_mt), the sync thread takes its lock for the flush;
+  // compressed_rotating_file_sink_sharded rejects it.
+  bool group_commit = false;
+  std::chrono::milliseconds commit_interval{10};
+  std::size_t commit_bytes = 1024 * 1024;
+
+  // Write records as details::encode_binary_record() instead of formatting them: the
+  // pattern formatter is skipped on the logging thread, and fewer bytes are left to
+  // rotate and compress. tools/BinaryLogDecoder.cpp renders them as text offline. set_pattern() and
+  // set_formatter() go back to text. sink_formatted() payloads must be encoded records.
+  bool binary_records = false;
+
+  // compressed_rotating_file_sink_mpsc: capacity of the record ring, in records
+  std::size_t mpsc_queue_size = 8192;
+};
+
+class compressed_rotating_file_sink_mpsc;
+class compressed_rotating_file_sink_sharded;
+
 //
 // Rotating file sink based on size
+// Policy narrows down at compile time what the options may enable, see dynamic_sink_policy.
 //
-template <typename Mutex>
+template <typename Mutex, typename Policy = dynamic_sink_policy>
 class compressed_rotating_file_sink final : public base_sink<Mutex> {
+  static_assert(Policy::compression || (!Policy::streaming && !Policy::seekable), "streaming and seekable archives need compression");
+
  public:
-  compressed_rotating_file_sink(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files, bool rotate_on_open = false);
+  compressed_rotating_file_sink(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files, bool rotate_on_open = false,
+                                compressed_rotating_sink_options options = {});
+  ~compressed_rotating_file_sink() override;
   static filename_t calc_filename(const filename_t& filename, std::size_t index);
   const filename_t& filename() const;
+  // lock-free, callable from any thread
+  compressed_rotating_sink_stats stats() const;
+  // blocks until every record logged before the call is on disk. with group_commit
+  // it waits for the sync thread, else flushes and syncs right away. false if a sync failed
+  bool wait_durable();
+  // Logs a record formatted upstream, eol included, e.g. once for every sink of a
+  // fan-out: the formatter is skipped, only the size check and the write are left.
+  void sink_formatted(string_view_t payload, log_clock::time_point time = log_clock::now());
 
  protected:
   void sink_it_(const details::log_msg& msg) override;
   void flush_() override;
 
  private:
+  friend class compressed_rotating_file_sink_mpsc;
+  friend class compressed_rotating_file_sink_sharded;
+
+  // size accounting, rotation and write of a formatted record
+  void write_formatted_(const memory_buf_t& formatted, log_clock::time_point time);
+
   // Rotate files:
   // log.txt -> log.1.txt
   // log.1.txt -> log.2.txt
   // log.2.txt -> log.3.txt
-  // log.3.txt -> delete
-  void rotate_();
-  void compress_();
+  // log.3.txt -> compressed
+  // false when log.txt could not be renamed, it is kept and the rotation retried later
+  bool rotate_();
+
+  // async mode only sets log.txt aside as staged, the cascade runs on the worker
+  bool rotate_index_(filename_t& staged, const details::archive_stamp& stamp);
+  // log.txt -> log.<seq>.txt
+  bool rotate_sequence_();
+  void notify_stats_();
+  // archive_callback, fills in the checksum
+  void notify_archive_(archive_event& event);
+  // metrics_, unless the policy has no stats
+  static void count_(details::sink_metrics::counter& counter, std::uint64_t n = 1) {
+    if (Policy::stats) {
+      details::sink_metrics::add(counter, n);
+    }
+  }
+  // undoes count_(), for gauges
+  static void uncount_(details::sink_metrics::counter& counter, std::uint64_t n = 1) {
+    if (Policy::stats) {
+      details::sink_metrics::sub(counter, n);
+    }
+  }
+  // throws if the options enable something the policy does not
+  void check_policy_() const;
+
+  // Streaming mode
+  void write_stream_(const memory_buf_t& formatted, log_clock::time_point time);
+  bool rotate_stream_();
+  // log.txt.gz -> log.txt.gz.<time>, then archived as log.<number>.txt.<time>.gz
+  bool archive_stream_file_();
+
+  // close the active file and rename it to <name><stamp.suffix()>, returns the new name.
+  // empty when the rename failed and the active file was kept.
+  filename_t stage_active_file_(const details::archive_stamp& stamp);
+  // before renaming the active file: returns the prepared next segment, or -1 after
+  // closing the active file
+  int detach_active_();
+  // after renaming it: a new active file (next_fd when prepared), or else append to
+  // the old one and defer the rotation by a growing backoff. the logging thread never
+  // sleeps on it.
+  bool reopen_active_(bool renamed, int next_fd);
+  // preallocate_files: log.txt.next becomes the active file, the old descriptor is retired
+  void swap_segment_(int next_fd);
+  // preallocate_files: create log.txt.next, on the worker if there is one. retires old_fd first
+  void prepare_segment_(int old_fd = -1);
+
+  // lazy_open, on the worker: scan the archives and finish rotating staged (if not empty)
+  void open_archives_(const filename_t& staged, const details::archive_stamp& stamp);
+  // blocks until open_archives_ is done, rethrows its error once
+  void wait_open_();
+  // archives the files scan_archives_ found staged and not archived (abandoned jobs, renames
+  // that ran out of retries, deferred_ left at destruction, a crash), oldest first, except
+  // the one of own. failures are left for the next open.
+  void adopt_staged_(const details::archive_stamp& own, bool on_worker);
+
+  // the index mode cascade, with newest taking the place of log.txt.
+  // on failure, failed is the file that could not be renamed.
+  bool shift_rotated_(const filename_t& newest, filename_t& failed, filename_t& failed_target);
+  // log.<max_files> that an archive failed on, in the way of the cascade: renamed to
+  // log.<max_files>.txt<stamp> and archived later. false if the rename failed
+  bool set_aside_oldest_(const filename_t& oldest);
+  // index mode on the worker: the cascade with staged as the newest, then log.<max_files> is archived
+  void finish_rotation_(const filename_t& staged, const details::archive_stamp& stamp, details::seek_frames frames);
+
+  // pick the rotated files due for compression and compress them, on the worker in async mode.
+  // staged: the file set aside by rotate_index_ in async mode.
+  // on_worker: called from a worker job, compress right away
+  void schedule_compress_(const filename_t& staged, const details::archive_stamp& stamp, bool on_worker = false);
+  void submit_compress_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames = {});
+  // run job on the worker, counted in pending_jobs_. false if discarded because the queue is full.
+  // abandonable: skipped with compression_shutdown_policy::abandon
+  bool post_job_(std::function<void()> job, bool may_discard, bool abandonable = true);
+  void job_done_();
+  // a rotated file deleted because the queue is full
+  void drop_rotated_(const filename_t& src);
+
+  // job wrapped for the worker: counted in pending_jobs_, skipped when abandonable and abandoned
+  std::function<void()> counted_job_(std::function<void()> job, bool abandonable);
+
+  // compress src to log.<number>.txt<stamp.suffix()><ext> and apply retention.
+  // a staged stream (see staged_stream_) is already compressed and only renamed.
+  // false if it failed, src is left in place.
+  bool compress_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames = {});
+  // codec_->learn() then archive_file_. what learn() threw is rethrown once src is
+  // archived on the worker, else kept in learn_error_ for write_formatted_
+  void archive_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, const details::seek_frames& frames, bool on_worker);
+  // compress_ once the deferred archives are done, else src joins them (log.<max_files>
+  // of index mode set aside first, out of the way of the cascade)
+  void archive_file_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, const details::seek_frames& frames);
+  // the deferred archives that are due, oldest first. false if some are left
+  bool archive_deferred_();
+  // src joins deferred_, the oldest is left on disk when it is full
+  void defer_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames);
+  // on the worker: a delayed job runs archive_deferred_ when the oldest is due
+  void schedule_retry_();
+  // src is log.txt<ext><stamp.suffix()>, set aside in streaming mode (maybe by an earlier run)
+  bool staged_stream_(const filename_t& src, const details::archive_stamp& stamp) const;
+
+  // seekable archives: frames recorded for the rotated file log.<number>.txt, removed from raw_frames_
+  details::seek_frames take_raw_frames_(std::size_t number);
+  // finish the stream's frame and start a new one
+  void cut_stream_frame_(log_clock::time_point time);
+  // stream_buf_ was written: counted in the seek frame and, with size_accounting::compressed, in current_size_
+  void stream_written_();
+  // an archive and its .idx
+  bool rename_archive_(const filename_t& src, const filename_t& target);
+  void remove_archive_(std::size_t number, const filename_t& tail);
+
+  // list the directory, and report every archive to the retention manager. caller holds archive_mutex_.
+  void scan_archives_();
+  void report_archive_(std::size_t number, const filename_t& tail, log_clock::time_point time);
+  // report_archive_ once archive_callback returned, unless the archive is gone by then
+  void report_notified_(const filename_t& tail, log_clock::time_point time);
+  // called by the retention manager
+  void evict_archive_(const filename_t& tail);
+
+  // on the worker, while nothing else is queued: the improvable archives, oldest first
+  void improve_archives_();
+
+  // lowest index of an archive in index mode
+  std::size_t first_archive_index_() const;
+
+  // rename archives up by one index and delete the oldest, false if a rename failed.
+  // a failed shift resumes where it stopped. caller holds archive_mutex_.
+  bool shift_archives_();
+
+  // delete the lowest numbered archives beyond max_compressed_files_. caller holds archive_mutex_.
+  void trim_archives_();
+
+  // append to the write block, or write through when batching is off
+  void write_(const memory_buf_t& buf, log_clock::time_point time);
+  void write_block_();
+  // every write to the active file goes through here
+  void write_file_(const memory_buf_t& buf);
+  file_event_handlers io_event_handlers_();
+  // group_commit, on the sync thread: flushes and returns a descriptor to sync, -1 if nothing was written
+  int capture_commit_(std::uint64_t& position);
 
   // delete the target if exists, and rename the src file  to target
   // return true on success, false otherwise.
@@ -55,35 +403,204 @@ class compressed_rotating_file_sink final : public base_sink<Mutex> {
   std::size_t max_files_;
   std::size_t max_compressed_files_;
   std::size_t current_size_;
+  compressed_rotating_sink_options options_;
+  details::rotation_schedule schedule_;
+  bool has_records_ = false;  // written since the last rotation
+  details::active_file_io file_io_;  // outlives file_helper_, whose handlers call it
   details::file_helper file_helper_;
-  path dir_;
+  details::sink_directory dir_;
   filename_t basename_;
   filename_t file_ext_;
+  std::shared_ptr<typename Policy::codec_type> codec_;
+  std::shared_ptr<details::compression_thread_pool> pool_;  // set when files are compressed in chunks
+  filename_t comp_ext_;
+  std::mutex archive_mutex_;
+  details::archive_index archives_;
+  std::size_t last_sequence_ = 0;
+  std::future<void> opened_;  // open_archives_ in lazy_open mode
+  log_clock::time_point retry_at_;  // of a rotation deferred by a failed rename
+  std::chrono::milliseconds retry_backoff_{0};
+  struct deferred_archive {
+    filename_t src;
+    std::size_t number;
+    details::archive_stamp stamp;
+    details::seek_frames frames;
+    std::size_t attempts;
+    std::chrono::steady_clock::time_point due;
+  };
+  std::vector<deferred_archive> deferred_;  // archives that failed, on the worker when there is one
+  bool retry_scheduled_ = false;            // on the worker
+  std::deque<filename_t> improvable_;       // tails of archives to recompress, guarded by archive_mutex_
+  std::atomic<bool> closing_{false};        // deferred archives get one last attempt
+  std::exception_ptr learn_error_;          // of codec_->learn() without a worker, thrown after the record
+  filename_t next_filename_;                // preallocate_files
+  std::atomic<int> next_fd_{-1};            // prepared by the worker, taken on rotation
+  details::seek_recorder seek_;
+  std::map<std::size_t, details::seek_frames> raw_frames_;  // by number of the rotated file
+  std::size_t retention_owner_ = 0;
+  details::sink_metrics metrics_;  // updated through count_() and uncount_()
+  std::unique_ptr<details::compression_stream> stream_;
+  memory_buf_t stream_buf_;
+  memory_buf_t formatted_;  // reused for every record
+  memory_buf_t block_;
+  log_clock::time_point block_time_;
+  std::shared_ptr<details::compression_worker> worker_;
+  std::mutex jobs_mutex_;
+  std::condition_variable jobs_cv_;
+  std::size_t pending_jobs_ = 0;
+  std::atomic<bool> abandon_jobs_{false};
+  std::uint64_t written_records_ = 0;  // group_commit positions
+  std::size_t uncommitted_bytes_ = 0;
+  bool unsynced_ = false;  // written to the active file or the stream since the last capture
+  std::unique_ptr<details::group_commit> commit_;
 };
 
 using compressed_rotating_file_sink_mt = compressed_rotating_file_sink<std::mutex>;
 using compressed_rotating_file_sink_st = compressed_rotating_file_sink<details::null_mutex>;
 
-template <typename Mutex>
-SPDLOG_INLINE compressed_rotating_file_sink<Mutex>::compressed_rotating_file_sink(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files,
-                                                                                  bool rotate_on_open)
-    : base_filename_(std::move(base_filename)), max_size_(max_size), max_files_(max_files), max_compressed_files_(max_comp_files) {
-  file_helper_.open(calc_filename(base_filename_, 0));
-  current_size_ = file_helper_.size();  // expensive. called only once
-  path p(base_filename_);
-  dir_ = p.parent_path();
-  filename_t file_name = p.filename().string();
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE compressed_rotating_file_sink<Mutex, Policy>::compressed_rotating_file_sink(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files,
+                                                                                          bool rotate_on_open, compressed_rotating_sink_options options)
+    : base_filename_(std::move(base_filename)),
+      max_size_(max_size),
+      max_files_(max_files),
+      max_compressed_files_(max_comp_files),
+      options_(std::move(options)),
+      schedule_(options_.rotation, options_.rotation_interval),
+      file_io_(options_.io_policy, options_.io_interval, options_.io_max_age),
+      file_helper_(io_event_handlers_()),
+      seek_(options_.seek_frame_size, Policy::compression && static_cast<bool>(options_.archive_callback)) {
+  block_.reserve(options_.write_block_size);
+  if (options_.async_compression || options_.lazy_open) {
+    worker_ = options_.worker ? options_.worker : std::make_shared<details::compression_worker>(options_.compression_queue_size);
+  }
+  check_policy_();
+  if (options_.group_commit && std::is_same<Mutex, details::null_mutex>::value) {
+    SPDLOG_THROW(spdlog_ex("compressed_rotating_file_sink: options.group_commit needs a sink with a mutex"));
+  }
+  codec_ = details::policy_codec<typename Policy::codec_type>::make(options_.codec);
+  comp_ext_ = codec_->extension();
+  bool can_stream = codec_->make_stream() != nullptr;
+  if ((options_.streaming || seek_.enabled()) && !can_stream) {
+    SPDLOG_THROW(spdlog_ex("compressed_rotating_file_sink: the codec does not support streaming"));
+  }
+  if (can_stream && !options_.streaming) {
+    if (options_.compression_pool) {
+      pool_ = options_.compression_pool;
+    } else if (options_.compression_threads > 1) {
+      pool_ = std::make_shared<details::compression_thread_pool>(options_.compression_threads);
+    }
+  }
+  if (options_.binary_records) {
+    base_sink<Mutex>::formatter_ = details::make_unique<details::binary_formatter>();
+  }
+  if (options_.group_commit && !options_.streaming) {
+    if (options_.binary_records) {
+      details::truncate_partial_binary_record(calc_filename(base_filename_, 0));
+    } else {
+      details::truncate_partial_record(calc_filename(base_filename_, 0));
+    }
+  }
+  file_helper_.open(options_.streaming ? base_filename_ + comp_ext_ : calc_filename(base_filename_, 0));
+  current_size_ = file_io_.size();
+  schedule_.reset(log_clock::now());
+  seek_.take(options_.streaming ? 0 : current_size_);
+  filename_t dir, file_name;
+  details::split_path(base_filename_, dir, file_name);
+  dir_ = details::sink_directory(dir);
   std::tie(basename_, file_ext_) = details::file_helper::split_by_extension(file_name);
-  if (rotate_on_open && current_size_ > 0) {
-    rotate_();
-    compress_();
+  archives_ = details::archive_index(dir, basename_, file_ext_, comp_ext_);
+  if (options_.retention) {
+    retention_owner_ = options_.retention->attach([this](const filename_t& tail) { evict_archive_(tail); });
+  }
+  // the uncompressed size of a leftover stream is unknown, and its last frame may be cut short
+  bool rotate_now = (options_.streaming || rotate_on_open) && current_size_ > 0;
+  if (options_.lazy_open) {
+    // only set the current file aside, its number is known after the scan
+    filename_t staged;
+    details::archive_stamp stamp;
+    if (rotate_now) {
+      stamp = details::archive_stamp::next();
+      staged = stage_active_file_(stamp);
+      if (!staged.empty()) {
+        current_size_ = 0;
+      }
+    }
+    auto done = std::make_shared<std::promise<void>>();
+    opened_ = done->get_future();
+    post_job_(
+        [this, staged, stamp, done] {
+          try {
+            open_archives_(staged, stamp);
+          } catch (...) {
+            done->set_exception(std::current_exception());
+            throw;
+          }
+          done->set_value();
+        },
+        false);
+  } else {
+    scan_archives_();
+    last_sequence_ = archives_.last_number();
+    if (options_.retention) {
+      options_.retention->enforce();
+    }
+    adopt_staged_({}, false);
+    if (rotate_now && (options_.streaming ? archive_stream_file_() : rotate_())) {
+      current_size_ = 0;
+    }
+  }
+  if (options_.streaming) {
+    stream_ = codec_->make_stream();
+  }
+  if (options_.preallocate_files) {
+    next_filename_ = file_helper_.filename() + ".next";
+    prepare_segment_();
+  }
+  if (options_.group_commit) {
+    commit_ = details::make_unique<details::group_commit>(options_.commit_interval, dir_.path().empty() ? filename_t(".") : dir_.path(), [this](std::uint64_t& position) { return capture_commit_(position); });
+  }
+}
+
+// waits for queued compressions of this sink, they reference it.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE compressed_rotating_file_sink<Mutex, Policy>::~compressed_rotating_file_sink() {
+  write_block_();
+  if (stream_) {
+    stream_buf_.clear();
+    stream_->finish(stream_buf_);
+    write_file_(stream_buf_);
+    stream_written_();
+    stream_.reset();
+  }
+  commit_.reset();  // a last sync
+  closing_ = true;  // what is left is found by the next open
+  if (!worker_) {
+    archive_deferred_();
+  }
+  if (options_.shutdown_policy == compression_shutdown_policy::abandon) {
+    abandon_jobs_ = true;
+  }
+  {
+    std::unique_lock<std::mutex> lock(jobs_mutex_);
+    while (!jobs_cv_.wait_for(lock, std::chrono::milliseconds(10), [this] { return pending_jobs_ == 0; })) {
+      worker_->hurry();  // a retry of this sink may be waiting for its time
+    }
+  }
+  if (options_.retention) {
+    options_.retention->detach(retention_owner_);
+  }
+  int next_fd = next_fd_.exchange(-1);
+  if (next_fd >= 0) {
+    details::retire_segment(next_fd);
+    dir_.remove(next_filename_);
   }
 }
 
 // calc filename according to index and file extension if exists.
 // e.g. calc_filename("logs/mylog.txt, 3) => "logs/mylog.3.txt".
-template <typename Mutex>
-SPDLOG_INLINE filename_t compressed_rotating_file_sink<Mutex>::calc_filename(const filename_t& filename, std::size_t index) {
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE filename_t compressed_rotating_file_sink<Mutex, Policy>::calc_filename(const filename_t& filename, std::size_t index) {
   if (index == 0u) {
     return filename;
   }
@@ -93,136 +610,1025 @@ SPDLOG_INLINE filename_t compressed_rotating_file_sink<Mutex>::calc_filename(con
   return fmt::format(SPDLOG_FILENAME_T("{}.{}{}"), basename, index, ext);
 }
 
-template <typename Mutex>
-SPDLOG_INLINE const filename_t& compressed_rotating_file_sink<Mutex>::filename() const {
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE const filename_t& compressed_rotating_file_sink<Mutex, Policy>::filename() const {
   return file_helper_.filename();
 }
 
-template <typename Mutex>
-SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::sink_it_(const details::log_msg& msg) {
-  memory_buf_t formatted;
-  base_sink<Mutex>::formatter_->format(msg, formatted);
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE compressed_rotating_sink_stats compressed_rotating_file_sink<Mutex, Policy>::stats() const {
+  return metrics_.snapshot();
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::wait_durable() {
+  std::uint64_t position;
+  {
+    std::lock_guard<Mutex> lock(base_sink<Mutex>::mutex_);
+    if (!commit_) {
+      flush_();
+      int fd = file_io_.dup();
+      bool synced = fd >= 0 && details::sync_fd(fd);
+      if (fd >= 0) {
+        details::close_fd(fd);
+      }
+      return synced;
+    }
+    position = written_records_;
+  }
+  commit_->request();
+  return commit_->wait(position);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE int compressed_rotating_file_sink<Mutex, Policy>::capture_commit_(std::uint64_t& position) {
+  std::lock_guard<Mutex> lock(base_sink<Mutex>::mutex_);
+  position = written_records_;
+  if (!unsynced_ && block_.size() == 0) {
+    return -1;
+  }
+  flush_();
+  unsynced_ = false;
+  return file_io_.dup();
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::check_policy_() const {
+  const char* disabled = nullptr;
+  if (!Policy::streaming && options_.streaming) {
+    disabled = "streaming";
+  } else if (!Policy::time_rotation && options_.rotation != rotation_clock::none) {
+    disabled = "rotation";
+  } else if (!Policy::write_blocks && options_.write_block_size > 0) {
+    disabled = "write_block_size";
+  } else if (!Policy::io_policies && options_.io_policy != write_io_policy::buffered) {
+    disabled = "io_policy";
+  } else if (!Policy::seekable && options_.seek_frame_size > 0) {
+    disabled = "seek_frame_size";
+  }
+  if (disabled != nullptr) {
+    SPDLOG_THROW(spdlog_ex(std::string("compressed_rotating_file_sink: options.") + disabled + " is disabled by the policy"));
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::notify_stats_() {
+  if (options_.stats_callback) {
+    options_.stats_callback(metrics_.snapshot());
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::notify_archive_(archive_event& event) {
+  if (!details::file_crc32c(event.filename, event.crc32c)) {
+    return;  // already gone, e.g. to retention
+  }
+  options_.archive_callback(event);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::sink_it_(const details::log_msg& msg) {
+  formatted_.clear();
+  base_sink<Mutex>::formatter_->format(msg, formatted_);
+  write_formatted_(formatted_, msg.time);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::sink_formatted(string_view_t payload, log_clock::time_point time) {
+  std::lock_guard<Mutex> lock(base_sink<Mutex>::mutex_);
+  formatted_.clear();
+  formatted_.append(payload.data(), payload.data() + payload.size());
+  write_formatted_(formatted_, time);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::write_formatted_(const memory_buf_t& formatted, log_clock::time_point time) {
+  count_(metrics_.records);
+  count_(metrics_.bytes_logged, formatted.size());
+  if (commit_) {
+    ++written_records_;
+    uncommitted_bytes_ += formatted.size();
+    if (uncommitted_bytes_ >= options_.commit_bytes) {
+      uncommitted_bytes_ = 0;
+      commit_->request();
+    }
+  }
+  if (Policy::time_rotation && schedule_.due(time) && time >= retry_at_) {
+    if (!has_records_ && current_size_ == 0) {
+      schedule_.reset(time);
+    } else if (Policy::streaming && stream_ ? rotate_stream_() : rotate_()) {
+      schedule_.reset(time);
+      current_size_ = 0;
+    }
+  }
+  has_records_ = true;
+  if (Policy::streaming && stream_) {
+    write_stream_(formatted, time);
+    return;
+  }
   current_size_ += formatted.size();
-  if (current_size_ > max_size_) {
-    rotate_();
-    compress_();
+  if (current_size_ > max_size_ && time >= retry_at_ && rotate_()) {
+    schedule_.reset(time);
     current_size_ = formatted.size();
   }
-  file_helper_.write(formatted);
+  if (seek_.recording()) {
+    seek_.record(formatted.size(), time);
+  }
+  write_(formatted, time);
+  if (learn_error_) {
+    std::exception_ptr error;
+    std::swap(error, learn_error_);
+    std::rethrow_exception(error);  // to the logger's error handler
+  }
 }
 
-template <typename Mutex>
-SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::flush_() {
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::flush_() {
+  write_block_();
+  if (Policy::streaming && stream_) {
+    stream_buf_.clear();
+    stream_->flush(stream_buf_);
+    write_file_(stream_buf_);
+    stream_written_();
+  }
+  file_io_.flush();
   file_helper_.flush();
 }
 
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::write_(const memory_buf_t& buf, log_clock::time_point time) {
+  if (!Policy::write_blocks || options_.write_block_size == 0) {
+    write_file_(buf);
+    return;
+  }
+
+  if (block_.size() == 0) {
+    block_time_ = time;
+  }
+  block_.append(buf.data(), buf.data() + buf.size());
+  if (block_.size() >= options_.write_block_size || (options_.write_block_age.count() > 0 && time - block_time_ >= options_.write_block_age)) {
+    write_block_();
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::write_block_() {
+  if (block_.size() > 0) {
+    write_file_(block_);
+    block_.clear();
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::write_file_(const memory_buf_t& buf) {
+  std::chrono::steady_clock::time_point start;
+  if (Policy::stats && options_.write_latency_stats) {
+    start = std::chrono::steady_clock::now();
+  }
+  if (!Policy::io_policies) {
+    file_helper_.write(buf);
+  } else if (!file_io_.write(buf)) {
+    file_helper_.write(buf);
+    file_io_.written(buf.size());
+  }
+  count_(metrics_.bytes_written, buf.size());
+  unsynced_ = true;
+  if (Policy::stats && options_.write_latency_stats) {
+    metrics_.writes.record(std::chrono::steady_clock::now() - start);
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE file_event_handlers compressed_rotating_file_sink<Mutex, Policy>::io_event_handlers_() {
+  file_event_handlers handlers;
+  handlers.after_open = [this](const filename_t& filename, std::FILE* file) { file_io_.opened(filename, file); };
+  handlers.before_close = [this](const filename_t&, std::FILE* file) { file_io_.closing(file); };
+  return handlers;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::write_stream_(const memory_buf_t& formatted, log_clock::time_point time) {
+  if (options_.accounting == size_accounting::uncompressed) {
+    current_size_ += formatted.size();
+    if (current_size_ > max_size_ && time >= retry_at_ && rotate_stream_()) {
+      schedule_.reset(time);
+      current_size_ = formatted.size();
+    }
+  }
+
+  if (seek_.recording()) {
+    if (seek_.frame_full()) {
+      cut_stream_frame_(time);
+    }
+    seek_.record(formatted.size(), time);
+  }
+  stream_buf_.clear();
+  stream_->write(formatted.data(), formatted.size(), stream_buf_);
+  if (stream_buf_.size() > 0) {
+    write_(stream_buf_, time);
+    stream_written_();
+  }
+  unsynced_ = true;  // the codec may hold the record back: the capture flushes the stream
+
+  if (options_.accounting == size_accounting::compressed) {
+    if (current_size_ >= max_size_ && time >= retry_at_ && rotate_stream_()) {
+      schedule_.reset(time);
+      has_records_ = false;
+      current_size_ = 0;
+    }
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rotate_stream_() {
+  wait_open_();
+  bool rotated;
+  {
+    details::scoped_latency<Policy::stats> timer(metrics_.rotation);
+    write_block_();
+    stream_buf_.clear();
+    stream_->finish(stream_buf_);
+    write_file_(stream_buf_);
+    stream_written_();
+    rotated = archive_stream_file_();
+    if (!rotated) {
+      seek_.end_frame();  // the kept file goes on with a new frame
+    }
+    stream_ = codec_->make_stream();
+  }
+  if (rotated) {
+    count_(metrics_.rotations);
+  }
+  notify_stats_();
+  return rotated;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::cut_stream_frame_(log_clock::time_point time) {
+  stream_buf_.clear();
+  stream_->finish(stream_buf_);
+  write_(stream_buf_, time);
+  stream_written_();
+  stream_ = codec_->make_stream();
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::stream_written_() {
+  seek_.compressed(stream_buf_.size());
+  if (options_.accounting == size_accounting::compressed) {
+    current_size_ += stream_buf_.size();
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::archive_stream_file_() {
+  details::archive_stamp stamp = details::archive_stamp::next();
+  filename_t staged = stage_active_file_(stamp);
+  if (staged.empty()) {
+    return false;
+  }
+  std::size_t number = options_.naming == archive_naming::sequence ? ++last_sequence_ : first_archive_index_();
+  submit_compress_(staged, number, stamp, seek_.take());
+  return true;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE filename_t compressed_rotating_file_sink<Mutex, Policy>::stage_active_file_(const details::archive_stamp& stamp) {
+  int next_fd = detach_active_();
+  filename_t src = options_.streaming ? base_filename_ + comp_ext_ : calc_filename(base_filename_, 0);
+  filename_t staged = src + stamp.suffix();
+  return reopen_active_(rename_file(src, staged), next_fd) ? staged : filename_t();
+}
+
+// A failed rename is neither slept on nor truncated away: records go on being
+// appended to the active file, and the first record after the backoff tries the
+// whole rotation again.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::reopen_active_(bool renamed, int next_fd) {
+  if (renamed) {
+    retry_backoff_ = std::chrono::milliseconds(0);
+    if (next_fd >= 0) {
+      swap_segment_(next_fd);
+    } else {
+      file_helper_.reopen(true);
+    }
+    return true;
+  }
+  count_(metrics_.rename_retries);
+  retry_backoff_ = retry_backoff_.count() == 0 ? options_.retry_backoff : std::min(retry_backoff_ * 2, options_.retry_backoff_max);
+  retry_at_ = log_clock::now() + retry_backoff_;
+  if (next_fd >= 0) {
+    next_fd_ = next_fd;  // the active file is still open, keep the segment for the retry
+  } else {
+    file_helper_.reopen(false);
+  }
+  return false;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE int compressed_rotating_file_sink<Mutex, Policy>::detach_active_() {
+  write_block_();
+  if (commit_) {
+    int fd = file_io_.dup();  // what is left of the file is synced at the next commit
+    if (fd >= 0) {
+      commit_->retire(fd);
+    }
+  }
+  int next_fd = next_fd_.exchange(-1);
+  if (next_fd < 0) {
+    file_helper_.close();
+  }
+  return next_fd;
+}
+
+// the FILE* of file_helper_ stays, only its descriptor changes, so file_helper_
+// keeps the name log.txt. falls back to reopening log.txt when the swap fails.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::swap_segment_(int next_fd) {
+  const filename_t& active = file_helper_.filename();
+  int old_fd = dir_.rename(next_filename_, active) ? file_io_.swap(active, next_fd) : -1;
+  if (old_fd < 0) {
+    details::retire_segment(next_fd);
+    file_helper_.close();
+    file_helper_.reopen(true);
+  }
+  prepare_segment_(old_fd);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::prepare_segment_(int old_fd) {
+  auto prepare = [this, old_fd] {
+    if (old_fd >= 0) {
+      details::retire_segment(old_fd);
+    }
+    next_fd_ = details::open_segment(next_filename_, max_size_);
+  };
+  // never dropped, it owns old_fd. done here when the queue is full
+  if (!worker_ || !post_job_(prepare, options_.overflow_policy == compression_overflow_policy::discard, false)) {
+    prepare();
+  }
+}
+
+// runs as the first job of the sink on the worker, before any compression it queues.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::open_archives_(const filename_t& staged, const details::archive_stamp& stamp) {
+  {
+    std::lock_guard<std::mutex> lock(archive_mutex_);
+    scan_archives_();
+    last_sequence_ = archives_.last_number();
+  }
+  if (options_.retention) {
+    options_.retention->enforce();
+  }
+  adopt_staged_(stamp, true);
+  if (staged.empty()) {
+    return;
+  }
+
+  if (options_.streaming) {
+    archive_(staged, options_.naming == archive_naming::sequence ? ++last_sequence_ : first_archive_index_(), stamp, {}, true);
+    return;
+  }
+  if (options_.naming == archive_naming::index) {
+    schedule_compress_(staged, stamp, true);
+    return;
+  }
+  filename_t target = calc_filename(base_filename_, last_sequence_ + 1);
+  if (!rename_file(staged, target)) {
+    count_(metrics_.rename_retries);
+    archive_(staged, ++last_sequence_, stamp, {}, true);  // archived as it is, without the rotated stage
+    return;
+  }
+  archives_.raw().insert(++last_sequence_);
+  schedule_compress_(staged, stamp, true);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::wait_open_() {
+  if (opened_.valid()) {
+    opened_.get();
+  }
+}
+
+// a staged file becomes the newest archive under the stamp of its rotation, without
+// going through the cascade: the rotated files are newer in index mode, but all that
+// is lost is the order of the numbers.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::adopt_staged_(const details::archive_stamp& own, bool on_worker) {
+  details::archive_index::staged_t staged;
+  {
+    std::lock_guard<std::mutex> lock(archive_mutex_);
+    staged.swap(archives_.staged());
+  }
+  for (const auto& file : staged) {
+    if (file.stamp.micros == own.micros) {
+      continue;  // archived by the caller
+    }
+    if (!Policy::compression) {
+      dir_.remove(file.filename);
+      continue;
+    }
+    std::size_t number = options_.naming == archive_naming::sequence ? ++last_sequence_ : first_archive_index_();
+    if (on_worker || !worker_) {
+      archive_file_(file.filename, number, file.stamp, {});
+    } else {
+      submit_compress_(file.filename, number, file.stamp);
+    }
+  }
+}
+
 // Rotate files:
 // log.txt -> log.1.txt
 // log.1.txt -> log.2.txt
 // log.2.txt -> log.3.txt
-// log.3.txt -> delete
-template <typename Mutex>
-SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::rotate_() {
-  using details::os::filename_to_str;
-  using details::os::path_exists;
-  file_helper_.close();
-  for (auto i = max_files_; i > 0; --i) {
-    filename_t src = calc_filename(base_filename_, i - 1);
-    if (!path_exists(src)) {
-      continue;
+// log.3.txt -> compressed
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rotate_() {
+  wait_open_();
+  filename_t staged;
+  details::archive_stamp stamp = details::archive_stamp::next();
+  bool rotated;
+  {
+    details::scoped_latency<Policy::stats> timer(metrics_.rotation);
+    rotated = options_.naming == archive_naming::sequence ? rotate_sequence_() : rotate_index_(staged, stamp);
+  }
+  if (rotated) {
+    count_(metrics_.rotations);
+    schedule_compress_(staged, stamp);
+  }
+  notify_stats_();
+  return rotated;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rotate_index_(filename_t& staged, const details::archive_stamp& stamp) {
+  filename_t active = calc_filename(base_filename_, 0);
+  int next_fd = detach_active_();
+  bool renamed;
+  if (worker_) {
+    // the worker owns log.1.txt and up, it may still be shifting them for the last rotation
+    staged = active + stamp.suffix();
+    renamed = rename_file(active, staged);
+  } else {
+    filename_t failed, failed_target;
+    renamed = shift_rotated_(active, failed, failed_target);
+  }
+  if (!reopen_active_(renamed, next_fd)) {
+    return false;
+  }
+  if (seek_.recording()) {
+    std::map<std::size_t, details::seek_frames> shifted;
+    for (auto& raw : raw_frames_) {
+      shifted.emplace(raw.first + 1, std::move(raw.second));
     }
-    filename_t target = calc_filename(base_filename_, i);
+    shifted[1] = seek_.take();
+    raw_frames_.swap(shifted);
+  }
+  return true;
+}
 
+// the cascade stops at the first free index, so one that failed half way
+// resumes where it stopped instead of renaming files twice.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::shift_rotated_(const filename_t& newest, filename_t& failed, filename_t& failed_target) {
+  std::size_t free = 1;
+  while (free < max_files_ && dir_.exists(calc_filename(base_filename_, free))) {
+    ++free;
+  }
+  for (auto i = std::min(free, max_files_); i > 0; --i) {
+    filename_t src = i == 1 ? newest : calc_filename(base_filename_, i - 1);
+    filename_t target = calc_filename(base_filename_, i);
+    if (i == max_files_ && dir_.exists(target) && !set_aside_oldest_(target)) {
+      failed = target;
+      failed_target = target + SPDLOG_FILENAME_T(".<stamp>");
+      return false;
+    }
     if (!rename_file(src, target)) {
-      // if failed try again after a small delay.
-      // this is a workaround to a windows issue, where very high rotation
-      // rates can cause the rename to fail with permission denied (because of antivirus?).
-      details::os::sleep_for_millis(100);
-      if (!rename_file(src, target)) {
-        file_helper_.reopen(true);  // truncate the log file anyway to prevent it to grow beyond its limit!
-        current_size_ = 0;
-        SPDLOG_THROW(spdlog_ex("rotating_file_sink: failed renaming " + filename_to_str(src) + " to " + filename_to_str(target), errno));
-      }
+      failed = src;
+      failed_target = target;
+      return false;
     }
   }
-  file_helper_.reopen(true);
+  return true;
+}
+
+// the set aside file is archived right away, or deferred when that fails
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::set_aside_oldest_(const filename_t& oldest) {
+  details::archive_stamp stamp = details::archive_stamp::next();
+  filename_t staged = oldest + stamp.suffix();
+  if (!rename_file(oldest, staged)) {
+    return false;
+  }
+  if (!Policy::compression) {
+    dir_.remove(staged);
+  } else {
+    archive_file_(staged, max_files_, stamp, {});
+  }
+  return true;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::finish_rotation_(const filename_t& staged, const details::archive_stamp& stamp, details::seek_frames frames) {
+  filename_t failed, failed_target;
+  if (!shift_rotated_(staged, failed, failed_target)) {
+    // the next cascade resumes where this one stopped. staged does not wait for it on
+    // the worker: it is archived as it is, out of the order of the numbers, as adopted
+    // files are, without its seek frames
+    count_(metrics_.rename_retries);
+    archive_(staged, first_archive_index_(), stamp, {}, true);
+    return;
+  }
+  filename_t file_to_compress = calc_filename(base_filename_, max_files_);
+  if (dir_.exists(file_to_compress)) {
+    archive_(file_to_compress, max_files_, stamp, frames, true);
+  }
+}
+
+// Sequence mode, a single rename:
+// log.txt -> log.8.txt
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rotate_sequence_() {
+  int next_fd = detach_active_();
+  if (!reopen_active_(rename_file(calc_filename(base_filename_, 0), calc_filename(base_filename_, last_sequence_ + 1)), next_fd)) {
+    return false;
+  }
+  archives_.raw().insert(++last_sequence_);
+  if (seek_.recording()) {
+    raw_frames_[last_sequence_] = seek_.take();
+  }
+  return true;
 }
 
 // delete the target if exists, and rename the src file  to target
 // return true on success, false otherwise.
-template <typename Mutex>
-SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex>::rename_file(const filename_t& src_filename, const filename_t& target_filename) {
-  // try to delete the target file in case it already exists.
-  (void)details::os::remove(target_filename);
-  return details::os::rename(src_filename, target_filename) == 0;
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rename_file(const filename_t& src_filename, const filename_t& target_filename) {
+  return dir_.rename(src_filename, target_filename);
 }
 
-template <typename Mutex>
-SPDLOG_INLINE void compressed_rotating_file_sink<Mutex>::compress_() {
-  using details::os::filename_to_str;
-  using details::os::path_exists;
+// Index mode: log.3.txt. In async mode the whole cascade is queued with it, so that
+// the worker is the only one renaming log.1.txt and up.
+// Sequence mode: every rotated file beyond the newest max_files_ - 1.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::schedule_compress_(const filename_t& staged, const details::archive_stamp& stamp, bool on_worker) {
+  if (options_.naming == archive_naming::sequence) {
+    std::size_t keep_raw = max_files_ > 0 ? max_files_ - 1 : 0;
+    auto& raw = archives_.raw();
+    while (raw.size() > keep_raw) {
+      std::size_t number = *raw.begin();
+      raw.erase(raw.begin());
+      if (on_worker) {
+        archive_(calc_filename(base_filename_, number), number, details::archive_stamp::next(), take_raw_frames_(number), true);
+      } else {
+        submit_compress_(calc_filename(base_filename_, number), number, details::archive_stamp::next(), take_raw_frames_(number));
+      }
+    }
+    return;
+  }
 
-  filename_t basename_local;
-  path dir_local = dir_;
-  const std::string comp_ext = Utility::compressedFileExt;
+  details::seek_frames frames = take_raw_frames_(max_files_);
+  if (on_worker) {
+    finish_rotation_(staged, stamp, std::move(frames));
+    return;
+  }
+  if (!worker_) {
+    filename_t file_to_compress = calc_filename(base_filename_, max_files_);
+    if (dir_.exists(file_to_compress)) {
+      archive_(file_to_compress, max_files_, stamp, frames, false);
+    }
+    return;
+  }
+  // jobs of this sink may still be renaming log.1.txt and up: when the queue is full,
+  // the file dropped is the newest rather than log.3.txt
+  if (!post_job_([this, staged, stamp, frames] { finish_rotation_(staged, stamp, frames); }, options_.overflow_policy == compression_overflow_policy::discard)) {
+    drop_rotated_(staged);
+  }
+}
 
-  if (dir_local.string().empty()) {
-    dir_local = "./";
-    basename_local = "./" + basename_;
-  } else {
-    basename_local = dir_local.string() + "/" + basename_;
-  }
-  std::size_t max_itr_value = (max_compressed_files_ + max_files_ - 1);
-
-  /* Regex for oldest compressed file */
-  std::string regex_oldest_file_str = basename_local + "." + std::to_string(max_itr_value) + file_ext_ + "(.*)" + comp_ext;
-  std::string regex_file_str = basename_local + "." + "([0-9]+)" + file_ext_ + "(.*)" + comp_ext;
-  try {
-    if (exists(dir_local)) {
-      filename_t src_name;
-      filename_t target_file;
-      std::smatch match_value;
-      filename_t name_replace;
-      filename_t name_replace_with;
-
-      for (auto x : directory_iterator(dir_local)) {
-        src_name = x.path().string();
-        if (std::regex_match(src_name, std::regex(regex_oldest_file_str))) {
-          // Delete the oldest compressed file
-          details::os::remove(src_name);
-        }
-
-        else if (std::regex_match(src_name, match_value, std::regex(regex_file_str))) {
-          target_file = src_name;
-          name_replace = basename_local + "." + match_value[1].str();
-          name_replace_with = basename_local + "." + std::to_string(std::stoi(match_value[1].str()) + 1);
-          boost::algorithm::replace_first(target_file, name_replace, name_replace_with);
-
-          if (!rename_file(src_name, target_file)) {
-            // if failed try again after a small delay.
-            // this is a workaround to a windows issue, where very high rotation
-            // rates can cause the rename to fail with permission denied (because of antivirus?).
-            details::os::sleep_for_millis(10);
-            if (!rename_file(src_name, target_file)) {
-              SPDLOG_THROW(spdlog_ex("rotating_file_sink: failed renaming " + filename_to_str(src_name) + " to " + filename_to_str(target_file), errno));
-            }
-          }
-        }  // else if(regex match)
-      }    // for(directory_itr)
-    }      // directory exists
-  } catch (const filesystem_error& err) {
-    SPDLOG_THROW(spdlog_ex("Exception in boost filesystem "));
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE details::seek_frames compressed_rotating_file_sink<Mutex, Policy>::take_raw_frames_(std::size_t number) {
+  details::seek_frames frames;
+  auto it = raw_frames_.find(number);
+  if (it != raw_frames_.end()) {
+    frames.swap(it->second);
+    raw_frames_.erase(it);
+  }
+  return frames;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::submit_compress_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames) {
+  if (!worker_) {
+    archive_(src, number, stamp, frames, false);
+    return;
+  }
+
+  if (!post_job_([this, src, number, stamp, frames] { archive_(src, number, stamp, frames, true); }, options_.overflow_policy == compression_overflow_policy::discard)) {
+    drop_rotated_(src);
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::drop_rotated_(const filename_t& src) {
+  std::uint64_t size = 0;
+  dir_.stat(src, size);
+  count_(metrics_.dropped_files);
+  count_(metrics_.dropped_bytes, size);
+  dir_.remove(src);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::archive_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, const details::seek_frames& frames,
+                                                                          bool on_worker) {
+  if (!Policy::compression) {
+    dir_.remove(src);  // the oldest rotated file goes, as in rotating_file_sink
+    return;
+  }
+  std::exception_ptr learn_error;  // src does not need what failed, it is archived first
+  if (!staged_stream_(src, stamp)) {
+    try {
+      codec_->learn(src);  // outside archive_mutex_, training a dictionary takes a while
+    } catch (...) {
+      learn_error = std::current_exception();
+    }
+  }
+  archive_file_(src, number, stamp, frames);
+  if (on_worker) {
+    improve_archives_();
+  }
+  if (learn_error && on_worker) {
+    std::rethrow_exception(learn_error);
+  }
+  if (learn_error) {
+    learn_error_ = learn_error;  // thrown here, it would repeat the rotation at each record
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::archive_file_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp,
+                                                                               const details::seek_frames& frames) {
+  if (archive_deferred_() && compress_(src, number, stamp, frames)) {
+    return;
+  }
+  if (options_.streaming || options_.naming == archive_naming::sequence || src != calc_filename(base_filename_, max_files_)) {
+    defer_(src, number, stamp, frames);
+    return;
+  }
+  // log.3.txt is taken by the next cascade, set it aside (or lose it to the cascade, as it always was)
+  filename_t staged = src + stamp.suffix();
+  if (rename_file(src, staged)) {
+    defer_(staged, number, stamp, frames);
+  }
+}
+
+// a deferred archive that is not due yet, or fails again, holds back the newer ones.
+// one given up on is left on disk: set aside, staged or rotated, the next open finds it.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::archive_deferred_() {
+  auto now = std::chrono::steady_clock::now();
+  while (!deferred_.empty()) {
+    deferred_archive& front = deferred_.front();
+    if (front.due > now && !closing_) {
+      return false;
+    }
+    if (!compress_(front.src, front.number, front.stamp, front.frames)) {
+      if (++front.attempts < options_.retry_attempts && !closing_) {
+        auto backoff = options_.retry_backoff * (std::size_t(1) << std::min<std::size_t>(front.attempts, 16));
+        front.due = now + std::min<std::chrono::milliseconds>(backoff, options_.retry_backoff_max);
+        return false;
+      }
+      count_(metrics_.rename_failures);
+    }
+    deferred_.erase(deferred_.begin());
+  }
+  return true;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::defer_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames) {
+  if (deferred_.size() >= std::max<std::size_t>(options_.compression_queue_size, 1)) {
+    count_(metrics_.rename_failures);
+    deferred_.erase(deferred_.begin());
+  }
+  deferred_.push_back(deferred_archive{src, number, stamp, std::move(frames), 0, std::chrono::steady_clock::now() + options_.retry_backoff});
+  if (worker_) {
+    schedule_retry_();
+  }
+}
+
+// one delayed job per sink at a time; it runs in between the jobs of the queue
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::schedule_retry_() {
+  if (retry_scheduled_ || deferred_.empty()) {
+    return;
+  }
+  retry_scheduled_ = true;
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    ++pending_jobs_;
   }
+  count_(metrics_.pending_jobs);
+  auto due = closing_ ? std::chrono::steady_clock::now() : deferred_.front().due;
+  worker_->post_after(due, counted_job_(
+                               [this] {
+                                 retry_scheduled_ = false;
+                                 archive_deferred_();
+                                 schedule_retry_();
+                               },
+                               true));
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::staged_stream_(const filename_t& src, const details::archive_stamp& stamp) const {
+  filename_t tail = comp_ext_ + stamp.suffix();
+  return src.size() >= tail.size() && src.compare(src.size() - tail.size(), tail.size(), tail) == 0;
+}
 
-  filename_t file_to_compress = calc_filename(base_filename_, (max_files_));
-  if (path_exists(file_to_compress)) {
-    filename_t new_compressed_file;
-    new_compressed_file = file_to_compress + "." + Utility::getTime();
-    if (Utility::compressFile(new_compressed_file, file_to_compress)) {
-      details::os::remove(file_to_compress);
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE std::function<void()> compressed_rotating_file_sink<Mutex, Policy>::counted_job_(std::function<void()> job, bool abandonable) {
+  return [this, job, abandonable] {
+    if (!abandonable || !abandon_jobs_) {
+      try {
+        job();
+      } catch (...) {
+        job_done_();
+        throw;
+      }
     }
+    job_done_();
+  };
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::post_job_(std::function<void()> job, bool may_discard, bool abandonable) {
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    ++pending_jobs_;
   }
+  count_(metrics_.pending_jobs);
+  auto counted = counted_job_(std::move(job), abandonable);
+  if (!may_discard) {
+    worker_->post(std::move(counted));
+  } else if (!worker_->try_post(std::move(counted))) {
+    job_done_();
+    return false;
+  }
+  return true;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::compress_(const filename_t& src, std::size_t number, const details::archive_stamp& stamp, details::seek_frames frames) {
+  std::unique_lock<std::mutex> lock(archive_mutex_);
+  if (options_.naming == archive_naming::index && !shift_archives_()) {
+    return false;
+  }
+  filename_t tail = stamp.suffix() + comp_ext_;
+  filename_t new_compressed_file = calc_filename(base_filename_, number) + tail;
+  archive_event event;
+  bool archived;
+  if (staged_stream_(src, stamp)) {
+    archived = rename_file(src, new_compressed_file);
+    details::frames_span(frames, event.bytes_in, event.first_time, event.last_time);
+  } else {
+    details::scoped_latency<Policy::stats> timer(metrics_.compression);
+    std::uint64_t size_in = 0, size_out = 0;
+    bool sized = dir_.stat(src, size_in);
+    codec_->compressing(worker_ ? worker_->pending() : 0);
+    auto start = std::chrono::steady_clock::now();
+    if (seek_.enabled()) {
+      archived = details::parallel_compress_file(*codec_, src, new_compressed_file, options_.seek_frame_size, pool_.get(), &frames);
+    } else {
+      archived = pool_ ? details::parallel_compress_file(*codec_, src, new_compressed_file, options_.compression_chunk_size, pool_.get())
+                       : codec_->compress_file(src, new_compressed_file);
+    }
+    if (archived) {
+      codec_->compressed(size_in, std::chrono::steady_clock::now() - start);
+    }
+    if (archived && sized && dir_.stat(new_compressed_file, size_out)) {
+      count_(metrics_.compression_bytes_in, size_in);
+      count_(metrics_.compression_bytes_out, size_out);
+    }
+    std::uint64_t recorded;
+    details::frames_span(frames, recorded, event.first_time, event.last_time);
+    event.bytes_in = size_in;
+  }
+  count_(archived ? metrics_.compressions : metrics_.compression_failures);
+  if (archived) {
+    if (!staged_stream_(src, stamp)) {
+      dir_.remove(src);
+    }
+    if (seek_.enabled() && !frames.empty()) {
+      details::write_seek_index(new_compressed_file + ".idx", frames);
+    }
+    archives_.entries().emplace(number, details::archive_entry{tail, stamp});
+    if (!options_.archive_callback) {
+      report_archive_(number, tail, stamp.time());
+    }
+    if (worker_ && !staged_stream_(src, stamp) && !seek_.enabled() && !options_.archive_callback && codec_->improvable()) {
+      improvable_.push_back(tail);
+      if (improvable_.size() > max_compressed_files_) {
+        improvable_.pop_front();
+      }
+    }
+  }
+  if (options_.naming == archive_naming::sequence) {
+    trim_archives_();
+  }
+  lock.unlock();
+  if (archived && options_.archive_callback) {
+    event.filename = std::move(new_compressed_file);
+    event.number = number;
+    event.rotation_time = stamp.time();
+    dir_.stat(event.filename, event.bytes_out);
+    notify_archive_(event);
+    report_notified_(tail, stamp.time());
+  }
+  if (options_.retention) {
+    options_.retention->enforce();  // may evict our archives, through evict_archive_
+  }
+  notify_stats_();
+  return archived;
 }  // compress_()
+
+// under archive_mutex_ like compress_, an eviction waits for the archive rather than
+// seeing it vanish and come back. the temporary is ignored by scan().
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::improve_archives_() {
+  while (worker_->pending() == 0) {
+    std::lock_guard<std::mutex> lock(archive_mutex_);
+    if (improvable_.empty()) {
+      return;
+    }
+    filename_t tail = std::move(improvable_.front());
+    improvable_.pop_front();
+    auto& entries = archives_.entries();
+    auto it = std::find_if(entries.begin(), entries.end(), [&tail](const details::archive_index::entries_t::value_type& entry) { return entry.second.tail == tail; });
+    if (it == entries.end()) {
+      continue;  // deleted meanwhile
+    }
+    filename_t archive = archives_.path(it->first, tail);
+    filename_t tmp = archive + SPDLOG_FILENAME_T(".tmp");
+    if (!codec_->recompress_file(archive, tmp) || !rename_file(tmp, archive)) {
+      dir_.remove(tmp);
+      continue;
+    }
+    count_(metrics_.recompressions);
+    if (options_.retention) {
+      options_.retention->removed(retention_owner_, tail);  // for the new size
+      report_archive_(it->first, tail, it->second.stamp.time());
+    }
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE std::size_t compressed_rotating_file_sink<Mutex, Policy>::first_archive_index_() const {
+  return options_.streaming ? 1 : max_files_;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::job_done_() {
+  {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    --pending_jobs_;
+  }
+  uncount_(metrics_.pending_jobs);
+  jobs_cv_.notify_all();
+}
+
+// log.3.txt.<time><ext> -> log.4.txt.<time><ext>, the oldest is deleted.
+// Only the run of archives from the first index up to the first free one moves:
+// after a failed rename there is a free index above it, and the next call resumes
+// there. The archive at the highest index kept is only deleted when the run reaches it.
+// works on the in-memory index, no directory listing; an archive found missing is
+// dropped from it.
+// caller holds archive_mutex_.
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::shift_archives_() {
+  std::size_t max_itr_value = (max_compressed_files_ + first_archive_index_() - 1);
+  details::archive_index::entries_t shifted;
+  auto& entries = archives_.entries();
+  std::size_t free = first_archive_index_();
+  while (entries.count(free) > 0) {
+    ++free;
+  }
+  bool ok = true;
+  for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+    bool in_run = it->first < free;
+    if (ok && (it->first > max_itr_value || (it->first == max_itr_value && in_run))) {
+      // Delete the oldest compressed file
+      remove_archive_(it->first, it->second.tail);
+      continue;
+    }
+    if (ok && in_run) {
+      filename_t src = archives_.path(it->first, it->second.tail);
+      if (rename_archive_(src, archives_.path(it->first + 1, it->second.tail))) {
+        shifted.emplace(it->first + 1, it->second);
+        continue;
+      }
+      if (errno == ENOENT && !dir_.exists(src)) {
+        remove_archive_(it->first, it->second.tail);  // deleted by someone else, e.g. a shipper
+        continue;
+      }
+      // on windows very high rotation rates can cause the rename to fail with
+      // permission denied (because of antivirus?), the caller retries later.
+      count_(metrics_.rename_retries);
+      ok = false;
+    }
+    shifted.emplace(it->first, it->second);
+  }
+  entries.swap(shifted);
+  return ok;
+}  // shift_archives_()
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::trim_archives_() {
+  auto& entries = archives_.entries();
+  while (entries.size() > max_compressed_files_) {
+    remove_archive_(entries.begin()->first, entries.begin()->second.tail);
+    entries.erase(entries.begin());
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE bool compressed_rotating_file_sink<Mutex, Policy>::rename_archive_(const filename_t& src, const filename_t& target) {
+  if (!rename_file(src, target)) {
+    return false;
+  }
+  if (seek_.enabled()) {
+    rename_file(src + ".idx", target + ".idx");  // archives written before seeking was enabled have none
+  }
+  return true;
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::remove_archive_(std::size_t number, const filename_t& tail) {
+  filename_t filename = archives_.path(number, tail);
+  dir_.remove(filename);
+  if (seek_.enabled()) {
+    dir_.remove(filename + ".idx");
+  }
+  if (options_.retention) {
+    options_.retention->removed(retention_owner_, tail);
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::scan_archives_() {
+  archives_.scan(dir_);
+  if (!options_.retention) {
+    return;
+  }
+  for (const auto& entry : archives_.entries()) {
+    if (entry.second.stamp.micros != 0) {
+      report_archive_(entry.first, entry.second.tail, entry.second.stamp.time());
+      continue;
+    }
+    std::uint64_t size;  // named before archive_stamp
+    log_clock::time_point mtime;
+    report_archive_(entry.first, entry.second.tail, dir_.stat(archives_.path(entry.first, entry.second.tail), size, &mtime) ? mtime : log_clock::now());
+  }
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::report_archive_(std::size_t number, const filename_t& tail, log_clock::time_point time) {
+  if (!options_.retention) {
+    return;
+  }
+  std::uint64_t size = 0;
+  dir_.stat(archives_.path(number, tail), size);
+  options_.retention->added(retention_owner_, tail, size, time);
+}
+
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::report_notified_(const filename_t& tail, log_clock::time_point time) {
+  if (!options_.retention) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(archive_mutex_);
+  for (const auto& entry : archives_.entries()) {
+    if (entry.second.tail == tail) {
+      if (dir_.exists(archives_.path(entry.first, tail))) {
+        report_archive_(entry.first, tail, time);  // not taken by the callback, e.g. a shipper
+      }
+      return;
+    }
+  }
+}
+
+// tails are unique within a sink, the number may have changed since the archive was reported
+template <typename Mutex, typename Policy>
+SPDLOG_INLINE void compressed_rotating_file_sink<Mutex, Policy>::evict_archive_(const filename_t& tail) {
+  std::lock_guard<std::mutex> lock(archive_mutex_);
+  auto& entries = archives_.entries();
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    if (it->second.tail == tail) {
+      remove_archive_(it->first, it->second.tail);
+      entries.erase(it);
+      return;
+    }
+  }
+}
 }  // namespace sinks
 }  // namespace spdlog
 
@@ -0,0 +1,1043 @@
+#ifndef COMPRESSION_CODEC_H
+#define COMPRESSION_CODEC_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CompressionWorker.h"
+#include "SeekIndex.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef COMPRESSED_SINK_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef COMPRESSED_SINK_USE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+#ifdef COMPRESSED_SINK_USE_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace spdlog {
+namespace details {
+
+//
+// Incremental compressor producing one frame per instance.
+// Compressed bytes are appended to out, they may lag behind the input until
+// flush() or finish() is called.
+//
+class compression_stream {
+ public:
+  virtual ~compression_stream() = default;
+  virtual void write(const char* data, std::size_t size, memory_buf_t& out) = 0;
+  // make everything written so far decodable, without ending the frame
+  virtual void flush(memory_buf_t& out) = 0;
+  // end the frame, the stream can not be written anymore
+  virtual void finish(memory_buf_t& out) = 0;
+};
+
+//
+// Compression algorithm used by compressed_rotating_file_sink.
+// A codec compresses whole rotated files, and when it can hand out
+// compression streams it also supports the sink's streaming mode.
+// compress_file() may be called from the compression worker, concurrently
+// with make_stream() on the logging thread.
+//
+class compression_codec {
+ public:
+  // receives decoded content in pieces, false stops the decoding
+  using decode_fn = std::function<bool(const char* data, std::size_t size)>;
+
+  virtual ~compression_codec() = default;
+
+  // appended to archive names, e.g. ".zst"
+  virtual filename_t extension() const = 0;
+
+  // nullptr when the codec can only compress whole files
+  virtual std::unique_ptr<compression_stream> make_stream() const { return nullptr; }
+
+  // compress src into target, the complete archive name. true on success.
+  // the default implementation feeds the file through make_stream().
+  virtual bool compress_file(const filename_t& src, const filename_t& target) const;
+
+  // the content of src, an archive of this codec, through out. false when the codec
+  // can not decode, the archive is damaged or out stopped it.
+  virtual bool decode_file(const filename_t& src, const decode_fn& out) const {
+    (void)src;
+    (void)out;
+    return false;
+  }
+
+  // called on the compressing thread with each rotated file before it is compressed,
+  // for codecs that learn from the data (zstd_trained_codec)
+  virtual void learn(const filename_t& src) const { (void)src; }
+
+  // called on the compressing thread around each rotated file, for codecs that adapt
+  // to the load (adaptive_codec): backlog is the number of jobs queued on the worker
+  virtual void compressing(std::size_t backlog) const { (void)backlog; }
+  virtual void compressed(std::uint64_t bytes_in, std::chrono::nanoseconds took) const {
+    (void)bytes_in;
+    (void)took;
+  }
+  // after compressed(): true when recompress_file() would do better with that archive,
+  // which the sink then does once its worker is idle
+  virtual bool improvable() const { return false; }
+  // src, an archive of this codec, compressed again into target. false when it fails
+  virtual bool recompress_file(const filename_t& src, const filename_t& target) const {
+    (void)src;
+    (void)target;
+    return false;
+  }
+};
+
+// Slice of the file being compressed. Points into the mapping when the
+// file is memory mapped, into storage otherwise.
+struct file_chunk {
+  const char* data = nullptr;
+  std::size_t size = 0;
+  std::shared_ptr<std::vector<char>> storage;
+};
+
+//
+// Hands out consecutive chunks of a closed log file to the compressor.
+// On POSIX the file is mapped with MADV_SEQUENTIAL so chunks reach the codec
+// without a copy, and pages the compressor is done with are dropped from the
+// mapping and the page cache, to keep old logs from evicting the application's
+// cache. Elsewhere, or when mapping fails, chunks are read into buffers.
+//
+class chunk_reader {
+ public:
+  chunk_reader(const filename_t& filename, std::size_t chunk_size);
+  chunk_reader(const chunk_reader&) = delete;
+  chunk_reader& operator=(const chunk_reader&) = delete;
+  ~chunk_reader();
+
+  bool is_open() const { return mapped_ != nullptr || file_ != nullptr; }
+  bool mapped() const { return mapped_ != nullptr; }
+  // false at the end of the file or on a read error
+  bool next(file_chunk& chunk) { return next(chunk, chunk_size_); }
+  bool next(file_chunk& chunk, std::size_t size);
+  bool failed() const { return file_ != nullptr && std::ferror(file_) != 0; }
+  // the chunks up to offset are compressed, their pages are no longer needed
+  void release_until(std::size_t offset);
+
+ private:
+  std::size_t chunk_size_;
+  std::FILE* file_ = nullptr;
+  char* mapped_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t offset_ = 0;    // next chunk
+  std::size_t released_ = 0;  // page aligned
+#ifndef _WIN32
+  int fd_ = -1;
+#endif
+};
+
+inline chunk_reader::chunk_reader(const filename_t& filename, std::size_t chunk_size) : chunk_size_(chunk_size > 0 ? chunk_size : 1) {
+#ifndef _WIN32
+  fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd_ >= 0 && ::fstat(fd_, &st) == 0 && st.st_size > 0) {
+    size_ = static_cast<std::size_t>(st.st_size);
+    void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p != MAP_FAILED) {
+      mapped_ = static_cast<char*>(p);
+      ::madvise(p, size_, MADV_SEQUENTIAL);
+      return;
+    }
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+#endif
+  if (os::fopen_s(&file_, filename, SPDLOG_FILENAME_T("rb"))) {
+    file_ = nullptr;
+  }
+}
+
+inline chunk_reader::~chunk_reader() {
+#ifndef _WIN32
+  if (mapped_ != nullptr) {
+    ::munmap(mapped_, size_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+  if (file_ != nullptr) {
+    std::fclose(file_);
+  }
+}
+
+inline bool chunk_reader::next(file_chunk& chunk, std::size_t size) {
+  size = size > 0 ? size : chunk_size_;
+  if (mapped_ != nullptr) {
+    if (offset_ >= size_) {
+      return false;
+    }
+    chunk.data = mapped_ + offset_;
+    chunk.size = std::min(size, size_ - offset_);
+    offset_ += chunk.size;
+    return true;
+  }
+
+  if (file_ == nullptr) {
+    return false;
+  }
+  chunk.storage = std::make_shared<std::vector<char>>(size);
+  chunk.size = std::fread(chunk.storage->data(), 1, size, file_);
+  chunk.data = chunk.storage->data();
+  return chunk.size > 0;
+}
+
+inline void chunk_reader::release_until(std::size_t offset) {
+#ifndef _WIN32
+  if (mapped_ == nullptr) {
+    return;
+  }
+  static const std::size_t page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  std::size_t end = offset >= size_ ? size_ : offset / page_size * page_size;
+  if (end > released_) {
+    ::madvise(mapped_ + released_, end - released_, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    ::posix_fadvise(fd_, static_cast<off_t>(released_), static_cast<off_t>(end - released_), POSIX_FADV_DONTNEED);
+#endif
+    released_ = end;
+  }
+#else
+  (void)offset;
+#endif
+}
+
+inline bool compression_codec::compress_file(const filename_t& src, const filename_t& target) const {
+  auto stream = make_stream();
+  if (!stream) {
+    return false;
+  }
+  chunk_reader reader(src, 256 * 1024);
+  std::FILE* out = nullptr;
+  if (!reader.is_open() || os::fopen_s(&out, target, SPDLOG_FILENAME_T("wb"))) {
+    return false;
+  }
+
+  memory_buf_t compressed;
+  file_chunk chunk;
+  std::size_t consumed = 0;
+  bool ok = true;
+  while (ok && reader.next(chunk)) {
+    compressed.clear();
+    stream->write(chunk.data, chunk.size, compressed);
+    ok = std::fwrite(compressed.data(), 1, compressed.size(), out) == compressed.size();
+    reader.release_until(consumed += chunk.size);
+  }
+  if (ok) {
+    compressed.clear();
+    stream->finish(compressed);
+    ok = std::fwrite(compressed.data(), 1, compressed.size(), out) == compressed.size();
+  }
+  ok = !reader.failed() && ok;
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok) {
+    os::remove(target);
+  }
+  return ok;
+}
+
+// Compresses src as a series of independent frames of chunk_size input bytes each,
+// compressed concurrently on the pool and written in order. Concatenated gzip
+// members, zstd frames and lz4 frames are valid files for the standard tools.
+// The codec must support make_stream(). Without a pool the frames are
+// compressed on the calling thread.
+// frames: when not empty, the frame sizes to cut src at (past them, chunk_size).
+// On return it describes every frame written, compressed offsets included.
+inline bool parallel_compress_file(const compression_codec& codec, const filename_t& src, const filename_t& target, std::size_t chunk_size,
+                                   compression_thread_pool* pool, seek_frames* frames = nullptr) {
+  chunk_reader reader(src, chunk_size);
+  std::FILE* out = nullptr;
+  if (!reader.is_open() || os::fopen_s(&out, target, SPDLOG_FILENAME_T("wb"))) {
+    return false;
+  }
+
+  using result_t = std::unique_ptr<memory_buf_t>;
+  auto submit = [pool](std::function<result_t()> task) {
+    if (pool != nullptr) {
+      return pool->submit(std::move(task));
+    }
+    std::packaged_task<result_t()> inline_task(std::move(task));
+    auto result = inline_task.get_future();
+    inline_task();
+    return result;
+  };
+  seek_frames planned;
+  if (frames != nullptr) {
+    planned.swap(*frames);
+  }
+
+  struct pending_chunk {
+    std::future<std::unique_ptr<memory_buf_t>> compressed;
+    std::size_t end_offset;
+  };
+  // bounds the memory held by chunks read ahead and compressed out of order
+  const std::size_t max_in_flight = pool != nullptr ? pool->size() * 2 : 1;
+  std::deque<pending_chunk> in_flight;
+  std::size_t offset = 0;
+  bool ok = true;
+  bool eof = false;
+  bool first = true;
+  std::size_t written_frames = 0;
+  std::uint64_t compressed_offset = 0;
+  try {
+    while (ok) {
+      while (!eof && in_flight.size() < max_in_flight) {
+        file_chunk chunk;
+        std::size_t index = frames != nullptr ? frames->size() : 0;
+        eof = !reader.next(chunk, index < planned.size() ? planned[index].size : chunk_size);
+        if (eof && !first) {
+          break;
+        }
+        first = false;  // an empty file still gets one (empty) frame
+        if (frames != nullptr) {
+          seek_frame frame = index < planned.size() ? planned[index] : seek_frame();
+          frame.offset = offset;
+          frame.size = chunk.size;
+          frames->push_back(frame);
+        }
+        offset += chunk.size;
+        in_flight.push_back({submit([&codec, chunk] {
+                               std::unique_ptr<memory_buf_t> compressed(new memory_buf_t());
+                               auto stream = codec.make_stream();
+                               stream->write(chunk.data, chunk.size, *compressed);
+                               stream->finish(*compressed);
+                               return compressed;
+                             }),
+                             offset});
+      }
+      if (in_flight.empty()) {
+        break;
+      }
+      auto compressed = in_flight.front().compressed.get();
+      reader.release_until(in_flight.front().end_offset);
+      in_flight.pop_front();
+      if (frames != nullptr) {
+        seek_frame& frame = (*frames)[written_frames++];
+        frame.compressed_offset = compressed_offset;
+        frame.compressed_size = compressed->size();
+        compressed_offset += compressed->size();
+      }
+      ok = std::fwrite(compressed->data(), 1, compressed->size(), out) == compressed->size();
+    }
+  } catch (const std::exception&) {
+    ok = false;
+  }
+  for (auto& pending : in_flight) {
+    pending.compressed.wait();  // tasks reference codec and the mapping
+  }
+
+  ok = !reader.failed() && ok;
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok) {
+    os::remove(target);
+  }
+  return ok;
+}
+
+//
+// Runs another codec at a level picked for each rotated file from the load:
+// - backlog above max_backlog: the fast level right away
+// - compressing took more than cpu_budget of the time between compressions
+//   (of one thread): one level faster
+// - backlog above twice max_backlog, with a copy_level: that level, which stores
+//   rather than compresses, e.g. 0 for gzip_codec or ZSTD_minCLevel() for zstd_codec
+// - compressing took more than cpu_budget of the time between compressions
+//   (of one thread): one level faster
+// - empty queue and under half the budget: one level better, up to best_level
+// Throughput per level is measured from the sink's compressed() calls.
+// Archives written below best_level are improvable(): the sink recompresses them at
+// best_level when its worker has nothing queued, which needs a codec that decodes
+// (gzip_codec, zstd_codec).
+// make builds the codec of a level, e.g. [](int l) { return std::make_shared<zstd_codec>(l); }
+// with -5 and 19, all levels must share an extension. Streams use the level of
+// the time they are made. cpu_budget 0 lets the backlog alone step down.
+//
+class adaptive_codec final : public compression_codec {
+ public:
+  using factory = std::function<std::shared_ptr<compression_codec>(int level)>;
+
+  static constexpr int no_copy_level = INT_MIN;
+
+  adaptive_codec(factory make, int fast_level, int best_level, std::size_t max_backlog = 2, double cpu_budget = 0.5, int copy_level = no_copy_level);
+
+  filename_t extension() const override { return codec_().extension(); }
+  std::unique_ptr<compression_stream> make_stream() const override { return codec_().make_stream(); }
+  bool compress_file(const filename_t& src, const filename_t& target) const override { return codec_().compress_file(src, target); }
+  bool decode_file(const filename_t& src, const decode_fn& out) const override { return codec_at_(best_level_).decode_file(src, out); }
+  void learn(const filename_t& src) const override { codec_().learn(src); }
+  void compressing(std::size_t backlog) const override;
+  void compressed(std::uint64_t bytes_in, std::chrono::nanoseconds took) const override;
+  bool improvable() const override { return level() < best_level_; }
+  bool recompress_file(const filename_t& src, const filename_t& target) const override;
+
+  int level() const;
+  // uncompressed bytes per second measured at level, 0 before it was used
+  double throughput(int level) const;
+
+ private:
+  // of the current level, built on first use
+  const compression_codec& codec_() const { return codec_at_(level()); }
+  const compression_codec& codec_at_(int level) const;
+
+  const factory make_;
+  const int fast_level_;
+  const int best_level_;
+  const std::size_t max_backlog_;
+  const double cpu_budget_;
+  const int copy_level_;
+  mutable std::mutex mutex_;
+  mutable int level_;
+  mutable double busy_ = 0;  // average share of the time spent compressing
+  mutable std::chrono::steady_clock::time_point last_done_;
+  mutable std::map<int, std::shared_ptr<compression_codec>> codecs_;
+  mutable std::map<int, double> throughput_;
+};
+
+inline adaptive_codec::adaptive_codec(factory make, int fast_level, int best_level, std::size_t max_backlog, double cpu_budget, int copy_level)
+    : make_(std::move(make)),
+      fast_level_(fast_level),
+      best_level_(std::max(fast_level, best_level)),
+      max_backlog_(max_backlog),
+      cpu_budget_(cpu_budget),
+      copy_level_(copy_level),
+      level_(fast_level) {
+  codec_();  // fails early on a bad factory
+}
+
+inline const compression_codec& adaptive_codec::codec_at_(int level) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& codec = codecs_[level];
+  if (!codec) {
+    codec = make_(level);
+    if (!codec) {
+      SPDLOG_THROW(spdlog_ex("adaptive_codec: no codec for level " + std::to_string(level)));
+    }
+  }
+  return *codec;  // codecs are kept, another thread may change the level meanwhile
+}
+
+// copy_level is below the others: stepping from it goes to fast_level
+inline void adaptive_codec::compressing(std::size_t backlog) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (copy_level_ != no_copy_level && backlog > 2 * max_backlog_) {
+    level_ = copy_level_;
+  } else if (backlog > max_backlog_) {
+    level_ = fast_level_;
+  } else if (cpu_budget_ > 0 && busy_ > cpu_budget_) {
+    level_ = std::max(fast_level_, level_ - 1);
+  } else if (backlog == 0 && (cpu_budget_ <= 0 || busy_ < cpu_budget_ / 2)) {
+    level_ = level_ < fast_level_ ? fast_level_ : std::min(best_level_, level_ + 1);
+  }
+}
+
+inline void adaptive_codec::compressed(std::uint64_t bytes_in, std::chrono::nanoseconds took) const {
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(took).count();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (seconds > 0) {
+    double rate = static_cast<double>(bytes_in) / seconds;
+    double& average = throughput_[level_];
+    average = average > 0 ? 0.7 * average + 0.3 * rate : rate;
+  }
+  if (last_done_ != std::chrono::steady_clock::time_point()) {
+    double interval = std::chrono::duration<double>(now - last_done_).count();
+    double busy = interval > seconds ? seconds / interval : 1.0;
+    busy_ = 0.7 * busy_ + 0.3 * busy;
+  }
+  last_done_ = now;
+}
+
+inline int adaptive_codec::level() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return level_;
+}
+
+inline double adaptive_codec::throughput(int level) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = throughput_.find(level);
+  return it != throughput_.end() ? it->second : 0;
+}
+
+// decoded and compressed again in one pass, without a plain copy on disk
+inline bool adaptive_codec::recompress_file(const filename_t& src, const filename_t& target) const {
+  const compression_codec& best = codec_at_(best_level_);
+  auto stream = best.make_stream();
+  std::FILE* out = nullptr;
+  if (!stream || os::fopen_s(&out, target, SPDLOG_FILENAME_T("wb"))) {
+    return false;
+  }
+  memory_buf_t compressed;
+  bool ok;
+  try {
+    ok = best.decode_file(src, [&](const char* data, std::size_t size) {
+      compressed.clear();
+      stream->write(data, size, compressed);
+      return std::fwrite(compressed.data(), 1, compressed.size(), out) == compressed.size();
+    });
+    if (ok) {
+      compressed.clear();
+      stream->finish(compressed);
+      ok = std::fwrite(compressed.data(), 1, compressed.size(), out) == compressed.size();
+    }
+  } catch (const std::exception&) {
+    ok = false;
+  }
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok) {
+    os::remove(target);
+  }
+  return ok;
+}
+
+#ifdef COMPRESSED_SINK_USE_ZLIB
+// gzip member written with zlib deflate.
+class gzip_stream final : public compression_stream {
+ public:
+  explicit gzip_stream(int level = Z_DEFAULT_COMPRESSION);
+  gzip_stream(const gzip_stream&) = delete;
+  gzip_stream& operator=(const gzip_stream&) = delete;
+  ~gzip_stream() override;
+
+  void write(const char* data, std::size_t size, memory_buf_t& out) override;
+  void flush(memory_buf_t& out) override;
+  void finish(memory_buf_t& out) override;
+
+ private:
+  void deflate_(int flush, memory_buf_t& out);
+
+  z_stream zs_;
+};
+
+inline gzip_stream::gzip_stream(int level) {
+  std::memset(&zs_, 0, sizeof(zs_));
+  // 15 + 16: largest window, gzip header and trailer
+  if (deflateInit2(&zs_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    SPDLOG_THROW(spdlog_ex("gzip_stream: deflateInit2 failed"));
+  }
+}
+
+inline gzip_stream::~gzip_stream() {
+  deflateEnd(&zs_);
+}
+
+inline void gzip_stream::write(const char* data, std::size_t size, memory_buf_t& out) {
+  zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zs_.avail_in = static_cast<uInt>(size);
+  deflate_(Z_NO_FLUSH, out);
+}
+
+inline void gzip_stream::flush(memory_buf_t& out) {
+  deflate_(Z_SYNC_FLUSH, out);
+}
+
+inline void gzip_stream::finish(memory_buf_t& out) {
+  deflate_(Z_FINISH, out);
+}
+
+inline void gzip_stream::deflate_(int flush, memory_buf_t& out) {
+  char chunk[16 * 1024];
+  int ret;
+  do {
+    zs_.next_out = reinterpret_cast<Bytef*>(chunk);
+    zs_.avail_out = sizeof(chunk);
+    ret = deflate(&zs_, flush);
+    if (ret == Z_STREAM_ERROR) {
+      SPDLOG_THROW(spdlog_ex("gzip_stream: deflate failed"));
+    }
+    out.append(chunk, chunk + (sizeof(chunk) - zs_.avail_out));
+  } while (zs_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+class gzip_codec final : public compression_codec {
+ public:
+  // level 0 stores the data in the gzip format without compressing it
+  explicit gzip_codec(int level = Z_DEFAULT_COMPRESSION) : level_(level) {}
+  filename_t extension() const override { return SPDLOG_FILENAME_T(".gz"); }
+  std::unique_ptr<compression_stream> make_stream() const override { return std::unique_ptr<compression_stream>(new gzip_stream(level_)); }
+  bool decode_file(const filename_t& src, const decode_fn& out) const override;
+
+ private:
+  int level_;
+};
+
+// every member of the file, parallel_compress_file and seekable archives write several
+inline bool gzip_codec::decode_file(const filename_t& src, const decode_fn& out) const {
+  std::FILE* in = nullptr;
+  if (os::fopen_s(&in, src, SPDLOG_FILENAME_T("rb"))) {
+    return false;
+  }
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    std::fclose(in);
+    return false;
+  }
+  std::vector<char> in_buf(64 * 1024), out_buf(64 * 1024);
+  int ret = Z_OK;
+  bool ok = true;
+  std::size_t n;
+  while (ok && (n = std::fread(in_buf.data(), 1, in_buf.size(), in)) > 0) {
+    zs.next_in = reinterpret_cast<Bytef*>(in_buf.data());
+    zs.avail_in = static_cast<uInt>(n);
+    do {
+      if (ret == Z_STREAM_END) {
+        inflateReset(&zs);  // the next member
+      }
+      zs.next_out = reinterpret_cast<Bytef*>(out_buf.data());
+      zs.avail_out = static_cast<uInt>(out_buf.size());
+      ret = inflate(&zs, Z_NO_FLUSH);
+      ok = (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) && out(out_buf.data(), out_buf.size() - zs.avail_out);
+    } while (ok && (zs.avail_in > 0 || (zs.avail_out == 0 && ret != Z_STREAM_END)));
+  }
+  ok = ok && ret == Z_STREAM_END && std::ferror(in) == 0;  // else cut short
+  inflateEnd(&zs);
+  std::fclose(in);
+  return ok;
+}
+#endif  // COMPRESSED_SINK_USE_ZLIB
+
+#ifdef COMPRESSED_SINK_USE_ZSTD
+// zstd frame, optionally with a dictionary and zstd's own worker threads
+// (those need libzstd built with ZSTD_MULTITHREAD).
+class zstd_stream final : public compression_stream {
+ public:
+  zstd_stream(int level, int workers, const ZSTD_CDict* dict);
+  // keeps dict alive until the stream is gone
+  zstd_stream(int level, int workers, std::shared_ptr<const ZSTD_CDict> dict) : zstd_stream(level, workers, dict.get()) { dict_owner_ = std::move(dict); }
+  zstd_stream(const zstd_stream&) = delete;
+  zstd_stream& operator=(const zstd_stream&) = delete;
+  ~zstd_stream() override;
+
+  void write(const char* data, std::size_t size, memory_buf_t& out) override;
+  void flush(memory_buf_t& out) override;
+  void finish(memory_buf_t& out) override;
+
+ private:
+  void compress_(ZSTD_inBuffer& in, ZSTD_EndDirective mode, memory_buf_t& out);
+
+  ZSTD_CCtx* cctx_;
+  std::shared_ptr<const ZSTD_CDict> dict_owner_;
+};
+
+inline zstd_stream::zstd_stream(int level, int workers, const ZSTD_CDict* dict) : cctx_(ZSTD_createCCtx()) {
+  if (cctx_ == nullptr) {
+    SPDLOG_THROW(spdlog_ex("zstd_stream: ZSTD_createCCtx failed"));
+  }
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_checksumFlag, 1);
+  if (workers > 0) {
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, workers);  // ignored without ZSTD_MULTITHREAD
+  }
+  if (dict != nullptr) {
+    ZSTD_CCtx_refCDict(cctx_, dict);
+  }
+}
+
+inline zstd_stream::~zstd_stream() {
+  ZSTD_freeCCtx(cctx_);
+}
+
+inline void zstd_stream::write(const char* data, std::size_t size, memory_buf_t& out) {
+  ZSTD_inBuffer in{data, size, 0};
+  compress_(in, ZSTD_e_continue, out);
+}
+
+inline void zstd_stream::flush(memory_buf_t& out) {
+  ZSTD_inBuffer in{nullptr, 0, 0};
+  compress_(in, ZSTD_e_flush, out);
+}
+
+inline void zstd_stream::finish(memory_buf_t& out) {
+  ZSTD_inBuffer in{nullptr, 0, 0};
+  compress_(in, ZSTD_e_end, out);
+}
+
+inline void zstd_stream::compress_(ZSTD_inBuffer& in, ZSTD_EndDirective mode, memory_buf_t& out) {
+  const std::size_t chunk = ZSTD_CStreamOutSize();
+  std::size_t remaining;
+  do {
+    std::size_t old_size = out.size();
+    out.resize(old_size + chunk);
+    ZSTD_outBuffer output{out.data() + old_size, chunk, 0};
+    remaining = ZSTD_compressStream2(cctx_, &output, &in, mode);
+    out.resize(old_size + output.pos);
+    if (ZSTD_isError(remaining)) {
+      SPDLOG_THROW(spdlog_ex(std::string("zstd_stream: ") + ZSTD_getErrorName(remaining)));
+    }
+  } while (mode == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+}
+
+class zstd_codec final : public compression_codec {
+ public:
+  // dictionary: raw content or a trained zstd dictionary, empty for none.
+  explicit zstd_codec(int level = 3, std::string dictionary = {}, int workers = 0);
+  zstd_codec(const zstd_codec&) = delete;
+  zstd_codec& operator=(const zstd_codec&) = delete;
+  ~zstd_codec() override;
+
+  filename_t extension() const override { return SPDLOG_FILENAME_T(".zst"); }
+  std::unique_ptr<compression_stream> make_stream() const override { return std::unique_ptr<compression_stream>(new zstd_stream(level_, workers_, dict_)); }
+  bool decode_file(const filename_t& src, const decode_fn& out) const override;
+
+ private:
+  int level_;
+  int workers_;
+  ZSTD_CDict* dict_ = nullptr;  // digested once, shared by all streams
+  ZSTD_DDict* ddict_ = nullptr;
+};
+
+inline zstd_codec::zstd_codec(int level, std::string dictionary, int workers) : level_(level), workers_(workers) {
+  if (!dictionary.empty()) {
+    dict_ = ZSTD_createCDict(dictionary.data(), dictionary.size(), level_);
+    ddict_ = ZSTD_createDDict(dictionary.data(), dictionary.size());
+    if (dict_ == nullptr || ddict_ == nullptr) {
+      ZSTD_freeCDict(dict_);
+      ZSTD_freeDDict(ddict_);
+      SPDLOG_THROW(spdlog_ex("zstd_codec: invalid dictionary"));
+    }
+  }
+}
+
+inline zstd_codec::~zstd_codec() {
+  ZSTD_freeCDict(dict_);
+  ZSTD_freeDDict(ddict_);
+}
+
+// every frame of the file, parallel_compress_file and seekable archives write several
+inline bool zstd_codec::decode_file(const filename_t& src, const decode_fn& out) const {
+  std::FILE* in = nullptr;
+  if (os::fopen_s(&in, src, SPDLOG_FILENAME_T("rb"))) {
+    return false;
+  }
+  std::unique_ptr<ZSTD_DCtx, std::size_t (*)(ZSTD_DCtx*)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  if (!dctx || (ddict_ != nullptr && ZSTD_isError(ZSTD_DCtx_refDDict(dctx.get(), ddict_)))) {
+    std::fclose(in);
+    return false;
+  }
+  std::vector<char> in_buf(ZSTD_DStreamInSize()), out_buf(ZSTD_DStreamOutSize());
+  std::size_t last = 0;  // 0 at the end of a frame
+  bool ok = true;
+  std::size_t n;
+  while (ok && (n = std::fread(in_buf.data(), 1, in_buf.size(), in)) > 0) {
+    ZSTD_inBuffer input{in_buf.data(), n, 0};
+    ZSTD_outBuffer output;
+    do {
+      output = ZSTD_outBuffer{out_buf.data(), out_buf.size(), 0};
+      last = ZSTD_decompressStream(dctx.get(), &output, &input);
+      ok = !ZSTD_isError(last) && out(out_buf.data(), output.pos);
+    } while (ok && (input.pos < input.size || output.pos == output.size));
+  }
+  ok = ok && last == 0 && std::ferror(in) == 0;  // else cut short
+  std::fclose(in);
+  return ok;
+}
+
+// Lines of log files gathered as zstd training samples, one sample per line.
+class zstd_samples {
+ public:
+  explicit zstd_samples(std::size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // adds the lines of the first max_file_bytes bytes of the file, up to max_bytes in total
+  bool add_file(const filename_t& filename, std::size_t max_file_bytes = static_cast<std::size_t>(-1));
+  bool full() const { return data_.size() >= max_bytes_; }
+  // a dictionary of up to dict_size bytes, empty when zstd found too little to learn from
+  std::string train(std::size_t dict_size) const;
+
+ private:
+  std::size_t max_bytes_;
+  std::string data_;
+  std::vector<std::size_t> sizes_;
+};
+
+inline bool zstd_samples::add_file(const filename_t& filename, std::size_t max_file_bytes) {
+  std::FILE* in = nullptr;
+  if (os::fopen_s(&in, filename, SPDLOG_FILENAME_T("rb"))) {
+    return false;
+  }
+  std::size_t budget = std::min(max_file_bytes, max_bytes_ - std::min(max_bytes_, data_.size()));
+  std::size_t start = data_.size();
+  data_.resize(start + budget);
+  std::size_t got = std::fread(&data_[start], 1, budget, in);
+  std::fclose(in);
+  data_.resize(start + got);
+  std::size_t line = start;
+  for (std::size_t i = start; i < data_.size(); ++i) {
+    if (data_[i] == '\n') {
+      sizes_.push_back(i + 1 - line);
+      line = i + 1;
+    }
+  }
+  data_.resize(line);  // a cut off line would teach zstd a wrong ending
+  return got > 0;
+}
+
+inline std::string zstd_samples::train(std::size_t dict_size) const {
+  std::string dict(dict_size, '\0');
+  std::size_t size = ZDICT_trainFromBuffer(&dict[0], dict.size(), data_.data(), sizes_.data(), static_cast<unsigned>(sizes_.size()));
+  if (ZDICT_isError(size)) {
+    return std::string();
+  }
+  dict.resize(size);
+  return dict;
+}
+
+// for zstd_codec, from sample files such as earlier logs
+inline std::string train_zstd_dictionary(const std::vector<filename_t>& samples, std::size_t dict_size = 112640) {
+  zstd_samples trainer(dict_size * 100);
+  for (const auto& sample : samples) {
+    trainer.add_file(sample);
+  }
+  return trainer.train(dict_size);
+}
+
+//
+// zstd with a dictionary trained on the first train_files rotated files (from
+// learn()), for logs of short, repetitive records. The dictionary is saved as
+// dictionary_file and loaded from it when it exists, so it is trained once and
+// has to be kept as long as the archives that need it (zstd -D <file> -d).
+// Archives compressed before the dictionary is ready have none. A dictionary that
+// could not be saved is not used: learn() throws, and saves it again next time.
+// In streaming mode no rotated files are compressed, only a dictionary_file that
+// exists is used.
+//
+class zstd_trained_codec final : public compression_codec {
+ public:
+  explicit zstd_trained_codec(filename_t dictionary_file, int level = 3, std::size_t train_files = 4, std::size_t dict_size = 112640, int workers = 0);
+  zstd_trained_codec(const zstd_trained_codec&) = delete;
+  zstd_trained_codec& operator=(const zstd_trained_codec&) = delete;
+
+  filename_t extension() const override { return SPDLOG_FILENAME_T(".zst"); }
+  std::unique_ptr<compression_stream> make_stream() const override;
+  void learn(const filename_t& src) const override;
+
+  bool trained() const { return dictionary() != nullptr; }
+  std::shared_ptr<const ZSTD_CDict> dictionary() const;
+
+ private:
+  void use_(const std::string& dict) const;
+  bool save_(const std::string& dict) const;
+
+  const filename_t dictionary_file_;
+  const int level_;
+  const std::size_t train_files_;
+  const std::size_t dict_size_;
+  const int workers_;
+  mutable std::mutex mutex_;
+  mutable std::shared_ptr<const ZSTD_CDict> dict_;
+  mutable std::unique_ptr<zstd_samples> samples_;  // until trained, or given up
+  mutable std::string unsaved_;                    // trained, waiting to be saved
+  mutable std::size_t learned_ = 0;
+};
+
+inline zstd_trained_codec::zstd_trained_codec(filename_t dictionary_file, int level, std::size_t train_files, std::size_t dict_size, int workers)
+    : dictionary_file_(std::move(dictionary_file)), level_(level), train_files_(train_files > 0 ? train_files : 1), dict_size_(dict_size), workers_(workers) {
+  std::FILE* in = nullptr;
+  if (!os::fopen_s(&in, dictionary_file_, SPDLOG_FILENAME_T("rb"))) {
+    std::string dict;
+    char buf[16384];
+    std::size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), in)) > 0) {
+      dict.append(buf, n);
+    }
+    std::fclose(in);
+    use_(dict);
+    return;
+  }
+  // zstd suggests about 100 times the dictionary size of samples
+  samples_.reset(new zstd_samples(dict_size_ * 100));
+}
+
+inline std::unique_ptr<compression_stream> zstd_trained_codec::make_stream() const {
+  return std::unique_ptr<compression_stream>(new zstd_stream(level_, workers_, dictionary()));
+}
+
+inline std::shared_ptr<const ZSTD_CDict> zstd_trained_codec::dictionary() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return dict_;
+}
+
+// the lock is held while training, other compressions wait for the dictionary
+inline void zstd_trained_codec::learn(const filename_t& src) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string dict;
+  if (!unsaved_.empty()) {
+    dict.swap(unsaved_);
+  } else if (!samples_) {
+    return;
+  } else {
+    samples_->add_file(src, dict_size_ * 100 / train_files_);
+    if (++learned_ < train_files_) {
+      return;
+    }
+    dict = samples_->train(dict_size_);
+    if (dict.empty()) {
+      if (samples_->full()) {
+        samples_.reset();  // more of the same will not help, go on without
+      }
+      return;
+    }
+    samples_.reset();
+  }
+  // archives made with a dictionary that is not on disk could never be read back
+  if (!save_(dict)) {
+    unsaved_.swap(dict);
+    SPDLOG_THROW(spdlog_ex("zstd_trained_codec: failed saving the dictionary to " + os::filename_to_str(dictionary_file_) + ", going on without", errno));
+  }
+  auto* cdict = ZSTD_createCDict(dict.data(), dict.size(), level_);
+  if (cdict != nullptr) {
+    dict_.reset(cdict, ZSTD_freeCDict);
+  }
+}
+
+inline void zstd_trained_codec::use_(const std::string& dict) const {
+  auto* cdict = ZSTD_createCDict(dict.data(), dict.size(), level_);
+  if (cdict == nullptr) {
+    SPDLOG_THROW(spdlog_ex("zstd_trained_codec: invalid dictionary " + os::filename_to_str(dictionary_file_)));
+  }
+  dict_.reset(cdict, ZSTD_freeCDict);
+}
+
+// through a temporary file, a dictionary file is complete or missing
+inline bool zstd_trained_codec::save_(const std::string& dict) const {
+  filename_t tmp = dictionary_file_ + SPDLOG_FILENAME_T(".tmp");
+  std::FILE* out = nullptr;
+  if (os::fopen_s(&out, tmp, SPDLOG_FILENAME_T("wb"))) {
+    return false;
+  }
+  bool ok = std::fwrite(dict.data(), 1, dict.size(), out) == dict.size();
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok || os::rename(tmp, dictionary_file_) != 0) {
+    os::remove(tmp);
+    return false;
+  }
+  return true;
+}
+#endif  // COMPRESSED_SINK_USE_ZSTD
+
+#ifdef COMPRESSED_SINK_USE_LZ4
+// lz4 frame
+class lz4_stream final : public compression_stream {
+ public:
+  explicit lz4_stream(int level);
+  lz4_stream(const lz4_stream&) = delete;
+  lz4_stream& operator=(const lz4_stream&) = delete;
+  ~lz4_stream() override;
+
+  void write(const char* data, std::size_t size, memory_buf_t& out) override;
+  void flush(memory_buf_t& out) override;
+  void finish(memory_buf_t& out) override;
+
+ private:
+  // reserves room for bound bytes, lets fn fill it and keeps what it wrote
+  template <typename Fn>
+  void append_(std::size_t bound, memory_buf_t& out, Fn fn);
+  // frame header, written before the first block
+  std::size_t begin_(char* dst, std::size_t capacity);
+
+  LZ4F_cctx* cctx_ = nullptr;
+  LZ4F_preferences_t prefs_;
+  bool header_written_ = false;
+};
+
+inline lz4_stream::lz4_stream(int level) {
+  std::memset(&prefs_, 0, sizeof(prefs_));
+  prefs_.compressionLevel = level;
+  prefs_.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+  if (LZ4F_isError(LZ4F_createCompressionContext(&cctx_, LZ4F_VERSION))) {
+    SPDLOG_THROW(spdlog_ex("lz4_stream: LZ4F_createCompressionContext failed"));
+  }
+}
+
+inline lz4_stream::~lz4_stream() {
+  LZ4F_freeCompressionContext(cctx_);
+}
+
+template <typename Fn>
+inline void lz4_stream::append_(std::size_t bound, memory_buf_t& out, Fn fn) {
+  bound += header_written_ ? 0 : LZ4F_HEADER_SIZE_MAX;
+  std::size_t old_size = out.size();
+  out.resize(old_size + bound);
+  std::size_t written = fn(out.data() + old_size, bound);
+  if (LZ4F_isError(written)) {
+    out.resize(old_size);
+    SPDLOG_THROW(spdlog_ex(std::string("lz4_stream: ") + LZ4F_getErrorName(written)));
+  }
+  out.resize(old_size + written);
+}
+
+inline std::size_t lz4_stream::begin_(char* dst, std::size_t capacity) {
+  if (header_written_) {
+    return 0;
+  }
+  header_written_ = true;
+  return LZ4F_compressBegin(cctx_, dst, capacity, &prefs_);
+}
+
+inline void lz4_stream::write(const char* data, std::size_t size, memory_buf_t& out) {
+  append_(LZ4F_compressBound(size, &prefs_), out, [&](char* dst, std::size_t cap) {
+    std::size_t header = begin_(dst, cap);
+    return LZ4F_isError(header) ? header : header + LZ4F_compressUpdate(cctx_, dst + header, cap - header, data, size, nullptr);
+  });
+}
+
+inline void lz4_stream::flush(memory_buf_t& out) {
+  append_(LZ4F_compressBound(0, &prefs_), out, [this](char* dst, std::size_t cap) {
+    std::size_t header = begin_(dst, cap);
+    return LZ4F_isError(header) ? header : header + LZ4F_flush(cctx_, dst + header, cap - header, nullptr);
+  });
+}
+
+inline void lz4_stream::finish(memory_buf_t& out) {
+  append_(LZ4F_compressBound(0, &prefs_), out, [this](char* dst, std::size_t cap) {
+    std::size_t header = begin_(dst, cap);
+    return LZ4F_isError(header) ? header : header + LZ4F_compressEnd(cctx_, dst + header, cap - header, nullptr);
+  });
+}
+
+class lz4_codec final : public compression_codec {
+ public:
+  // level 0 is the fast default, 3 and above select lz4hc
+  explicit lz4_codec(int level = 0) : level_(level) {}
+  filename_t extension() const override { return SPDLOG_FILENAME_T(".lz4"); }
+  std::unique_ptr<compression_stream> make_stream() const override { return std::unique_ptr<compression_stream>(new lz4_stream(level_)); }
+
+ private:
+  int level_;
+};
+#endif  // COMPRESSED_SINK_USE_LZ4
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef COMPRESSION_WORKER_H
+#define COMPRESSION_WORKER_H
+
+#include <spdlog/common.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace spdlog {
+namespace details {
+
+//
+// Background executor for rotated file compression.
+// Jobs run one at a time, in the order they were posted, on a dedicated thread.
+// The queue is bounded: post() blocks while it is full, try_post() fails instead.
+// post_after() keeps a job aside until its time, e.g. a retry, outside the bound:
+// the thread goes on with the queue meanwhile.
+// A single worker may be shared between several sinks.
+//
+class compression_worker {
+ public:
+  using job_t = std::function<void()>;
+
+  explicit compression_worker(std::size_t max_queue_size = 16);
+  compression_worker(const compression_worker&) = delete;
+  compression_worker& operator=(const compression_worker&) = delete;
+
+  // runs every job still in the queue or delayed, then joins the thread.
+  ~compression_worker();
+
+  void post(job_t job);
+  bool try_post(job_t job);
+  void post_after(std::chrono::steady_clock::time_point when, job_t job);
+  // runs the jobs of post_after() now, e.g. for a sink that is closing
+  void hurry();
+  std::size_t pending() const;
+
+ private:
+  void worker_loop_();
+
+  const std::size_t max_queue_size_;
+  mutable std::mutex mutex_;
+  std::condition_variable push_cv_;
+  std::condition_variable pop_cv_;
+  std::deque<job_t> queue_;
+  std::multimap<std::chrono::steady_clock::time_point, job_t> delayed_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+inline compression_worker::compression_worker(std::size_t max_queue_size) : max_queue_size_(max_queue_size > 0 ? max_queue_size : 1) {
+  thread_ = std::thread(&compression_worker::worker_loop_, this);
+}
+
+inline compression_worker::~compression_worker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  pop_cv_.notify_all();
+  push_cv_.notify_all();
+  thread_.join();
+}
+
+inline void compression_worker::post(job_t job) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    push_cv_.wait(lock, [this] { return queue_.size() < max_queue_size_; });
+    queue_.push_back(std::move(job));
+  }
+  pop_cv_.notify_one();
+}
+
+inline bool compression_worker::try_post(job_t job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_.size() >= max_queue_size_) {
+      return false;
+    }
+    queue_.push_back(std::move(job));
+  }
+  pop_cv_.notify_one();
+  return true;
+}
+
+inline void compression_worker::post_after(std::chrono::steady_clock::time_point when, job_t job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    delayed_.emplace(when, std::move(job));
+  }
+  pop_cv_.notify_one();
+}
+
+inline void compression_worker::hurry() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::multimap<std::chrono::steady_clock::time_point, job_t> due;
+    for (auto& delayed : delayed_) {
+      due.emplace(std::chrono::steady_clock::time_point::min(), std::move(delayed.second));
+    }
+    delayed_.swap(due);
+  }
+  pop_cv_.notify_one();
+}
+
+inline std::size_t compression_worker::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+inline void compression_worker::worker_loop_() {
+  for (;;) {
+    job_t job;
+    bool popped = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        // delayed jobs that are due go first, all of them once stopping
+        if (!delayed_.empty() && (stop_ || delayed_.begin()->first <= std::chrono::steady_clock::now())) {
+          job = std::move(delayed_.begin()->second);
+          delayed_.erase(delayed_.begin());
+          break;
+        }
+        if (!queue_.empty()) {
+          job = std::move(queue_.front());
+          queue_.pop_front();
+          popped = true;
+          break;
+        }
+        if (stop_) {
+          return;  // stopped and drained
+        }
+        if (delayed_.empty()) {
+          pop_cv_.wait(lock);
+        } else {
+          pop_cv_.wait_until(lock, delayed_.begin()->first);
+        }
+      }
+    }
+    if (popped) {
+      push_cv_.notify_one();
+    }
+    try {
+      job();
+    } catch (const std::exception& ex) {
+      std::fprintf(stderr, "[*** LOG ERROR ***] compression worker: %s\n", ex.what());
+    } catch (...) {
+      std::fprintf(stderr, "[*** LOG ERROR ***] compression worker: unknown exception\n");
+    }
+  }
+}
+
+//
+// Fixed set of threads for compressing chunks of one file in parallel.
+// Unlike compression_worker, tasks run concurrently and hand back their
+// result through a future.
+//
+class compression_thread_pool {
+ public:
+  explicit compression_thread_pool(std::size_t threads);
+  compression_thread_pool(const compression_thread_pool&) = delete;
+  compression_thread_pool& operator=(const compression_thread_pool&) = delete;
+  ~compression_thread_pool();
+
+  template <typename F>
+  auto submit(F task) -> std::future<decltype(task())>;
+  std::size_t size() const { return threads_.size(); }
+
+ private:
+  void thread_loop_();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+inline compression_thread_pool::compression_thread_pool(std::size_t threads) {
+  for (std::size_t i = 0; i < (threads > 0 ? threads : 1); ++i) {
+    threads_.emplace_back(&compression_thread_pool::thread_loop_, this);
+  }
+}
+
+inline compression_thread_pool::~compression_thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+template <typename F>
+inline auto compression_thread_pool::submit(F task) -> std::future<decltype(task())> {
+  using result_t = decltype(task());
+  // std::function needs a copyable target
+  auto packaged = std::make_shared<std::packaged_task<result_t()>>(std::move(task));
+  auto result = packaged->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace_back([packaged] { (*packaged)(); });
+  }
+  cv_.notify_one();
+  return result;
+}
+
+inline void compression_thread_pool::thread_loop_() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();  // exceptions are stored in the future
+  }
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef FILE_IO_POLICY_H
+#define FILE_IO_POLICY_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "UringIo.h"
+
+namespace spdlog {
+namespace sinks {
+
+// How the active log file is written, see details::active_file_io.
+enum class write_io_policy {
+  buffered,          // plain stdio writes
+  smooth_writeback,  // start writeback of every io_interval bytes instead of leaving it to the flusher
+  drop_behind,       // as smooth_writeback, and drop written data from the page cache
+  direct,            // O_DIRECT writes from an aligned buffer of io_interval bytes
+  io_uring,          // io_uring writes of io_interval bytes each, with COMPRESSED_SINK_USE_IO_URING on Linux
+};
+
+}  // namespace sinks
+
+namespace details {
+
+//
+// Applies a write_io_policy to the active file of a sink.
+// It follows the file_helper through its event handlers: opened() from
+// after_open and closing() from before_close.
+//
+// smooth_writeback / drop_behind: every interval bytes, start writeback of
+// what was written since the last call (sync_file_range on Linux). For
+// drop_behind, also wait for the previous interval to be written and drop
+// it with posix_fadvise(DONTNEED), so log data does not stay in the page cache.
+//
+// direct: writes bypass stdio and the page cache through an O_DIRECT
+// descriptor, in whole aligned blocks. The unaligned tail is written through
+// a regular descriptor on flush and rewritten once its block fills up.
+// Falls back to buffered writes when the filesystem refuses O_DIRECT.
+//
+// io_uring: writes bypass stdio through details::uring_writer, on a descriptor
+// of its own: records fill buffers of interval bytes, each submitted when full or
+// max_age after its first record (at the next write), and written by the kernel
+// while the next one fills. flush() and closing() wait for them. Falls back to buffered writes without COMPRESSED_SINK_USE_IO_URING
+// or when io_uring_setup fails (old kernel, seccomp).
+//
+class active_file_io {
+ public:
+  // max_age: io_uring only, see uring_writer
+  active_file_io(sinks::write_io_policy policy, std::size_t interval, std::chrono::milliseconds max_age = std::chrono::milliseconds(0));
+  active_file_io(const active_file_io&) = delete;
+  active_file_io& operator=(const active_file_io&) = delete;
+  ~active_file_io();
+
+  void opened(const filename_t& filename, std::FILE* file);
+  void closing(std::FILE* file);
+
+  // false when the caller has to write buf through the file_helper itself
+  bool write(const memory_buf_t& buf);
+  // after buf was written through the file_helper
+  void written(std::size_t size);
+  void flush();
+  // size of the active file, known from the fstat in opened()
+  std::size_t size() const { return offset_; }
+  // The active file was renamed while open: writes go on in next_fd, now named
+  // filename, through the same FILE*. Returns a descriptor of the old file for
+  // retire_segment(), or -1 when nothing was swapped and next_fd is still the caller's.
+  int swap(const filename_t& filename, int next_fd);
+  // a new descriptor of the active file, e.g. to sync it on another thread. -1 if none
+  int dup() const;
+
+ private:
+  static constexpr std::size_t alignment = 4096;
+
+  bool direct_flush_(bool write_tail);
+  void close_direct_();
+  void writeback_();
+
+  sinks::write_io_policy policy_;
+  std::size_t interval_;
+  std::FILE* file_ = nullptr;
+  std::size_t offset_ = 0;       // end of the file
+  std::size_t started_ = 0;      // writeback started up to here
+  std::size_t dropped_ = 0;      // dropped from the page cache up to here
+#ifndef _WIN32
+  int direct_fd_ = -1;
+  int tail_fd_ = -1;
+  char* buffer_ = nullptr;       // data from block_offset_ on
+  std::size_t buffered_ = 0;
+  std::size_t block_offset_ = 0;
+  int uring_fd_ = -1;
+#endif
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  std::unique_ptr<uring_writer> uring_;
+#endif
+};
+
+inline active_file_io::active_file_io(sinks::write_io_policy policy, std::size_t interval, std::chrono::milliseconds max_age) : policy_(policy) {
+  interval_ = (interval + alignment - 1) / alignment * alignment;
+  interval_ = interval_ > 0 ? interval_ : alignment;
+#ifndef _WIN32
+  if (policy_ == sinks::write_io_policy::direct && ::posix_memalign(reinterpret_cast<void**>(&buffer_), alignment, interval_) != 0) {
+    buffer_ = nullptr;
+    policy_ = sinks::write_io_policy::buffered;
+  }
+#endif
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  if (policy_ == sinks::write_io_policy::io_uring) {
+    uring_.reset(new uring_writer(4, interval_, max_age));
+    if (!uring_->ok()) {
+      uring_.reset();
+    }
+  }
+  if (!uring_) {
+    policy_ = policy_ == sinks::write_io_policy::io_uring ? sinks::write_io_policy::buffered : policy_;
+  }
+#else
+  (void)max_age;
+  policy_ = policy_ == sinks::write_io_policy::io_uring ? sinks::write_io_policy::buffered : policy_;
+#endif
+}
+
+inline active_file_io::~active_file_io() {
+#ifndef _WIN32
+  std::free(buffer_);
+#endif
+}
+
+inline void active_file_io::opened(const filename_t& filename, std::FILE* file) {
+  file_ = file;
+  offset_ = os::filesize(file);
+  started_ = dropped_ = offset_;
+#ifndef _WIN32
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  if (uring_) {
+    uring_fd_ = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);  // without O_APPEND, writes are at their offsets
+    if (uring_fd_ >= 0) {
+      uring_->open(uring_fd_, offset_);
+    }
+    return;
+  }
+#endif
+  if (policy_ != sinks::write_io_policy::direct) {
+    return;
+  }
+#ifdef O_DIRECT
+  direct_fd_ = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC | O_DIRECT);
+#endif
+  tail_fd_ = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+  block_offset_ = offset_ / alignment * alignment;
+  buffered_ = offset_ - block_offset_;
+  if (direct_fd_ < 0 || tail_fd_ < 0 || (buffered_ > 0 && ::pread(tail_fd_, buffer_, buffered_, static_cast<off_t>(block_offset_)) != static_cast<ssize_t>(buffered_))) {
+    close_direct_();  // no O_DIRECT here (e.g. tmpfs), write buffered
+  }
+#else
+  (void)filename;
+#endif
+}
+
+inline void active_file_io::closing(std::FILE*) {
+#ifndef _WIN32
+  if (direct_fd_ >= 0) {
+    direct_flush_(true);
+  }
+  close_direct_();
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  if (uring_fd_ >= 0) {
+    uring_->drain();
+    ::close(uring_fd_);
+    uring_fd_ = -1;
+  }
+#endif
+#endif
+  file_ = nullptr;
+}
+
+inline int active_file_io::swap(const filename_t& filename, int next_fd) {
+#ifndef _WIN32
+  std::FILE* file = file_;
+  if (file == nullptr || std::fflush(file) != 0) {
+    return -1;
+  }
+  int fd = ::fileno(file);
+  int old_fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (old_fd < 0) {
+    return -1;
+  }
+  closing(file);  // the O_DIRECT tail still goes to the old file
+  if (::dup2(next_fd, fd) < 0) {
+    ::close(old_fd);
+    return -1;
+  }
+  ::close(next_fd);
+  opened(filename, file);
+  return old_fd;
+#else
+  (void)filename;
+  (void)next_fd;
+  return -1;
+#endif
+}
+
+inline int active_file_io::dup() const {
+  if (file_ == nullptr) {
+    return -1;
+  }
+#ifndef _WIN32
+  return ::fcntl(::fileno(file_), F_DUPFD_CLOEXEC, 0);
+#else
+  return ::_dup(::_fileno(file_));
+#endif
+}
+
+inline void active_file_io::close_direct_() {
+#ifndef _WIN32
+  if (direct_fd_ >= 0) {
+    ::close(direct_fd_);
+    direct_fd_ = -1;
+  }
+  if (tail_fd_ >= 0) {
+    ::close(tail_fd_);
+    tail_fd_ = -1;
+  }
+#endif
+}
+
+inline bool active_file_io::write(const memory_buf_t& buf) {
+#ifndef _WIN32
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  if (uring_fd_ >= 0) {
+    offset_ += buf.size();  // taken by the writer even when it reports a failure
+    if (!uring_->write(buf.data(), buf.size())) {
+      SPDLOG_THROW(spdlog_ex("active_file_io: io_uring write failed", errno));
+    }
+    return true;
+  }
+#endif
+  if (direct_fd_ < 0) {
+    return false;
+  }
+  const char* data = buf.data();
+  std::size_t size = buf.size();
+  while (size > 0) {
+    std::size_t n = std::min(size, interval_ - buffered_);
+    std::memcpy(buffer_ + buffered_, data, n);
+    buffered_ += n;
+    data += n;
+    size -= n;
+    if (buffered_ == interval_ && !direct_flush_(false)) {
+      SPDLOG_THROW(spdlog_ex("active_file_io: O_DIRECT write failed", errno));
+    }
+  }
+  offset_ += buf.size();
+  return true;
+#else
+  (void)buf;
+  return false;
+#endif
+}
+
+inline void active_file_io::written(std::size_t size) {
+  offset_ += size;
+  if ((policy_ == sinks::write_io_policy::smooth_writeback || policy_ == sinks::write_io_policy::drop_behind) && offset_ - started_ >= interval_) {
+    writeback_();
+  }
+}
+
+inline void active_file_io::flush() {
+#ifndef _WIN32
+  if (direct_fd_ >= 0 && !direct_flush_(true)) {
+    SPDLOG_THROW(spdlog_ex("active_file_io: O_DIRECT write failed", errno));
+  }
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+  if (uring_fd_ >= 0 && !uring_->drain()) {
+    SPDLOG_THROW(spdlog_ex("active_file_io: io_uring write failed", errno));
+  }
+#endif
+#endif
+}
+
+// writes the whole blocks in the buffer, and the unaligned tail if asked to.
+// the tail stays buffered, its block is rewritten once complete.
+inline bool active_file_io::direct_flush_(bool write_tail) {
+#ifndef _WIN32
+  std::size_t whole = buffered_ / alignment * alignment;
+  std::size_t tail = buffered_ - whole;
+  if (whole > 0) {
+    if (::pwrite(direct_fd_, buffer_, whole, static_cast<off_t>(block_offset_)) != static_cast<ssize_t>(whole)) {
+      return false;
+    }
+    block_offset_ += whole;
+    std::memmove(buffer_, buffer_ + whole, tail);
+    buffered_ = tail;
+  }
+  if (write_tail && tail > 0 && ::pwrite(tail_fd_, buffer_, tail, static_cast<off_t>(block_offset_)) != static_cast<ssize_t>(tail)) {
+    return false;
+  }
+#else
+  (void)write_tail;
+#endif
+  return true;
+}
+
+inline void active_file_io::writeback_() {
+#ifndef _WIN32
+  if (file_ == nullptr || std::fflush(file_) != 0) {
+    return;
+  }
+  int fd = ::fileno(file_);
+#ifdef __linux__
+  ::sync_file_range(fd, static_cast<off64_t>(started_), static_cast<off64_t>(offset_ - started_), SYNC_FILE_RANGE_WRITE);
+  if (policy_ == sinks::write_io_policy::drop_behind && started_ > dropped_) {
+    // the previous interval had a full interval to reach the disk, wait for the rest of it
+    ::sync_file_range(fd, static_cast<off64_t>(dropped_), static_cast<off64_t>(started_ - dropped_),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  }
+#endif
+  if (policy_ == sinks::write_io_policy::drop_behind && started_ > dropped_) {
+#ifdef POSIX_FADV_DONTNEED
+    ::posix_fadvise(fd, static_cast<off_t>(dropped_), static_cast<off_t>(started_ - dropped_), POSIX_FADV_DONTNEED);
+#endif
+    dropped_ = started_;
+  }
+  started_ = offset_;
+#endif
+}
+
+// Creates an empty file for the next segment with size bytes preallocated, its size
+// stays 0 so appends start at the beginning. -1 where descriptors can not be swapped.
+inline int open_segment(const filename_t& filename, std::size_t size) {
+#ifndef _WIN32
+  int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fd >= 0 && size > 0) {
+    (void)::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size));  // best effort, e.g. tmpfs has no extents
+  }
+#else
+  (void)size;
+#endif
+  return fd;
+#else
+  (void)filename;
+  (void)size;
+  return -1;
+#endif
+}
+
+// closes a segment of open_segment() or active_file_io::swap(), after freeing the
+// blocks preallocated past its end
+inline void retire_segment(int fd) {
+#ifndef _WIN32
+  struct stat st;
+  if (::fstat(fd, &st) == 0) {
+    (void)::ftruncate(fd, st.st_size);
+  }
+  ::close(fd);
+#else
+  (void)fd;
+#endif
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
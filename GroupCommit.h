@@ -0,0 +1,227 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace spdlog {
+namespace details {
+
+// fdatasync where there is one, true on success
+inline bool sync_fd(int fd) {
+#if defined(_WIN32)
+  return ::_commit(fd) == 0;
+#elif defined(__APPLE__)
+  return ::fsync(fd) == 0;
+#else
+  return ::fdatasync(fd) == 0;
+#endif
+}
+
+inline void close_fd(int fd) {
+#ifdef _WIN32
+  ::_close(fd);
+#else
+  ::close(fd);
+#endif
+}
+
+// Cuts a log file back to its last complete record, the one ending with eol,
+// after a crash left part of a record at its end. Returns the bytes removed.
+inline std::size_t truncate_partial_record(const filename_t& filename, char eol = '\n') {
+#ifndef _WIN32
+  int fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  off_t end = ::fstat(fd, &st) == 0 ? st.st_size : 0;
+  off_t keep = end;
+  char buf[4096];
+  while (keep > 0) {
+    off_t from = std::max<off_t>(0, keep - static_cast<off_t>(sizeof(buf)));
+    ssize_t n = ::pread(fd, buf, static_cast<std::size_t>(keep - from), from);
+    if (n != keep - from) {
+      keep = end;  // unreadable, leave it alone
+      break;
+    }
+    const char* last = std::find(std::reverse_iterator<const char*>(buf + n), std::reverse_iterator<const char*>(buf), eol).base();
+    if (last != buf) {
+      keep = from + (last - buf);
+      break;
+    }
+    keep = from;
+  }
+  if (keep < end && ::ftruncate(fd, keep) != 0) {
+    keep = end;
+  }
+  ::close(fd);
+  return static_cast<std::size_t>(end - keep);
+#else
+  (void)filename;
+  (void)eol;
+  return 0;
+#endif
+}
+
+//
+// Group commit of a log file: a thread syncs the file every interval, or at
+// request(), so one fdatasync covers every record written since the last one.
+// Positions are counted by the owner (e.g. records written); capture() runs on
+// the commit thread, pushes what was written so far to the kernel, and returns
+// a descriptor of the file to sync along with the position it covers (-1 for
+// nothing new). Descriptors of rotated files are synced at the next commit,
+// with the directory, and closed.
+//
+class group_commit {
+ public:
+  using capture_fn = std::function<int(std::uint64_t& position)>;
+
+  group_commit(std::chrono::milliseconds interval, filename_t dir, capture_fn capture);
+  group_commit(const group_commit&) = delete;
+  group_commit& operator=(const group_commit&) = delete;
+  // commits once more, then joins the thread
+  ~group_commit();
+
+  // commit now instead of at the end of the interval
+  void request();
+  void retire(int fd);
+  // blocks until position is durable. false if a sync failed, nothing is durable since
+  bool wait(std::uint64_t position);
+
+ private:
+  void loop_();
+  void commit_();
+
+  const std::chrono::milliseconds interval_;
+  const filename_t dir_;
+  const capture_fn capture_;
+  std::mutex mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable durable_cv_;
+  bool requested_ = false;
+  bool stop_ = false;
+  bool failed_ = false;
+  std::uint64_t durable_ = 0;
+  std::vector<int> retired_;
+  std::thread thread_;
+};
+
+inline group_commit::group_commit(std::chrono::milliseconds interval, filename_t dir, capture_fn capture)
+    : interval_(interval.count() > 0 ? interval : std::chrono::milliseconds(1)), dir_(std::move(dir)), capture_(std::move(capture)) {
+  thread_ = std::thread(&group_commit::loop_, this);
+}
+
+inline group_commit::~group_commit() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_cv_.notify_one();
+  thread_.join();
+}
+
+inline void group_commit::request() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requested_ = true;
+  }
+  wake_cv_.notify_one();
+}
+
+inline void group_commit::retire(int fd) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  retired_.push_back(fd);
+}
+
+inline bool group_commit::wait(std::uint64_t position) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  durable_cv_.wait(lock, [this, position] { return durable_ >= position || failed_; });
+  return !failed_;
+}
+
+inline void group_commit::loop_() {
+  for (;;) {
+    bool stopping;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_cv_.wait_for(lock, interval_, [this] { return requested_ || stop_; });
+      requested_ = false;
+      stopping = stop_;
+    }
+    commit_();
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+inline void group_commit::commit_() {
+  std::uint64_t position = 0;
+  int fd = -1;
+  bool ok = true;
+  try {
+    fd = capture_(position);
+  } catch (const std::exception& ex) {
+    std::fprintf(stderr, "[*** LOG ERROR ***] group commit: %s\n", ex.what());
+    ok = false;
+  }
+  std::vector<int> retired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired.swap(retired_);
+  }
+  for (int old_fd : retired) {
+    ok = sync_fd(old_fd) && ok;
+    close_fd(old_fd);
+  }
+#ifndef _WIN32
+  if (!retired.empty()) {
+    int dir_fd = ::open(dir_.c_str(), O_RDONLY | O_CLOEXEC);  // the renames of the rotation
+    if (dir_fd >= 0) {
+      ok = ::fsync(dir_fd) == 0 && ok;
+      ::close(dir_fd);
+    }
+  }
+#endif
+  if (fd >= 0) {
+    ok = sync_fd(fd) && ok;
+    close_fd(fd);
+  }
+  if (!ok) {
+    std::fprintf(stderr, "[*** LOG ERROR ***] group commit: sync failed\n");
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) {
+      failed_ = true;
+    } else {
+      durable_ = std::max(durable_, position);  // with fd < 0, synced by an earlier commit
+    }
+  }
+  durable_cv_.notify_all();
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <spdlog/common.h>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace spdlog {
+namespace details {
+
+//
+// Bounded lock-free ring of formatted records, many producers and one consumer.
+// Based on D. Vyukov's bounded queue: every slot carries a sequence number that
+// tells producers when it is free and the consumer when it is published.
+// Producers claim a position with one CAS and copy the record into the slot,
+// whose buffer keeps its capacity from one lap to the next.
+// push() yields while the ring is full.
+//
+class mpsc_record_ring {
+ public:
+  struct alignas(64) slot {
+    std::atomic<std::size_t> sequence{0};
+    memory_buf_t data;
+    log_clock::time_point time;
+    bool flush = false;  // no record, the consumer flushes when it gets here
+  };
+
+  // capacity is rounded up to a power of two
+  explicit mpsc_record_ring(std::size_t capacity);
+  mpsc_record_ring(const mpsc_record_ring&) = delete;
+  mpsc_record_ring& operator=(const mpsc_record_ring&) = delete;
+
+  // returns the position of the record, positions of successive pushes grow by one
+  std::size_t push(string_view_t data, log_clock::time_point time, bool flush);
+
+  // consumer side. front() is nullptr while the next slot is not published
+  slot* front();
+  void pop();
+  // position of the slot front() returns
+  std::size_t position() const { return dequeue_pos_; }
+
+ private:
+  std::vector<slot> slots_;
+  std::size_t mask_;
+  alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+  alignas(64) std::size_t dequeue_pos_ = 0;
+};
+
+inline mpsc_record_ring::mpsc_record_ring(std::size_t capacity) {
+  std::size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  slots_ = std::vector<slot>(size);
+  mask_ = size - 1;
+  for (std::size_t i = 0; i < size; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+inline std::size_t mpsc_record_ring::push(string_view_t data, log_clock::time_point time, bool flush) {
+  std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  slot* s;
+  for (;;) {
+    s = &slots_[pos & mask_];
+    std::size_t seq = s->sequence.load(std::memory_order_acquire);
+    auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      std::this_thread::yield();  // full, wait for the consumer
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  s->data.clear();
+  s->data.append(data.data(), data.data() + data.size());
+  s->time = time;
+  s->flush = flush;
+  s->sequence.store(pos + 1, std::memory_order_release);
+  return pos;
+}
+
+inline mpsc_record_ring::slot* mpsc_record_ring::front() {
+  slot* s = &slots_[dequeue_pos_ & mask_];
+  return s->sequence.load(std::memory_order_acquire) == dequeue_pos_ + 1 ? s : nullptr;
+}
+
+inline void mpsc_record_ring::pop() {
+  slots_[dequeue_pos_ & mask_].sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+  ++dequeue_pos_;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
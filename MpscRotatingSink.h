@@ -0,0 +1,224 @@
+#ifndef MPSC_ROTATING_SINK_H
+#define MPSC_ROTATING_SINK_H
+
+#include <spdlog/details/null_mutex.h>
+#include <spdlog/pattern_formatter.h>
+#include <spdlog/sinks/sink.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CompressedRotatingSink.h"
+#include "MpscQueue.h"
+
+namespace spdlog {
+namespace sinks {
+
+//
+// compressed_rotating_file_sink for many logging threads.
+// Producers format on their own thread, with a per-thread clone of the formatter,
+// and publish the record into a lock-free ring (details::mpsc_record_ring).
+// One consumer thread owns a compressed_rotating_file_sink_st and does the
+// writes, size accounting and rotation, so no lock is shared by producers.
+// flush() returns once every record logged before it is written and flushed.
+//
+class compressed_rotating_file_sink_mpsc final : public sink {
+ public:
+  compressed_rotating_file_sink_mpsc(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files, bool rotate_on_open = false,
+                                     compressed_rotating_sink_options options = {});
+  compressed_rotating_file_sink_mpsc(const compressed_rotating_file_sink_mpsc&) = delete;
+  compressed_rotating_file_sink_mpsc& operator=(const compressed_rotating_file_sink_mpsc&) = delete;
+  // writes every queued record, then joins the consumer
+  ~compressed_rotating_file_sink_mpsc() override;
+
+  void log(const details::log_msg& msg) override;
+  void flush() override;
+  void set_pattern(const std::string& pattern) override;
+  void set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) override;
+  // a record formatted upstream, eol included, published as it is
+  void sink_formatted(string_view_t payload, log_clock::time_point time = log_clock::now()) { publish_(payload, time, false, nullptr); }
+
+  const filename_t& filename() const { return backend_->filename(); }
+  compressed_rotating_sink_stats stats() const { return backend_->stats(); }
+
+ private:
+  struct producer_state {
+    std::uint64_t sink_id = 0;
+    std::uint64_t generation = 0;  // of formatter
+    std::unique_ptr<spdlog::formatter> formatter;
+    memory_buf_t formatted;
+  };
+
+  static std::uint64_t next_sink_id_();
+  // the calling thread's formatter and buffer for this sink
+  producer_state& producer_();
+  void publish_(string_view_t formatted, log_clock::time_point time, bool flush, std::size_t* pos);
+  void consumer_loop_();
+  void wait_for_records_();
+
+  std::unique_ptr<compressed_rotating_file_sink_st> backend_;
+  details::mpsc_record_ring ring_;
+  const std::uint64_t id_;
+  std::mutex formatter_mutex_;
+  std::unique_ptr<spdlog::formatter> formatter_;
+  std::atomic<std::uint64_t> generation_{1};
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> sleeping_{false};
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  std::mutex flush_mutex_;
+  std::condition_variable flush_cv_;
+  std::size_t flushed_ = 0;  // every position below is flushed
+  std::thread consumer_;
+};
+
+inline compressed_rotating_file_sink_mpsc::compressed_rotating_file_sink_mpsc(filename_t base_filename, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files,
+                                                                              bool rotate_on_open, compressed_rotating_sink_options options)
+    : ring_(options.mpsc_queue_size), id_(next_sink_id_()), formatter_(options.binary_records ? std::unique_ptr<spdlog::formatter>(new details::binary_formatter()) : details::make_unique<spdlog::pattern_formatter>()) {
+  backend_ = details::make_unique<compressed_rotating_file_sink_st>(std::move(base_filename), max_size, max_files, max_comp_files, rotate_on_open, std::move(options));
+  consumer_ = std::thread(&compressed_rotating_file_sink_mpsc::consumer_loop_, this);
+}
+
+inline compressed_rotating_file_sink_mpsc::~compressed_rotating_file_sink_mpsc() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    stop_ = true;
+  }
+  wake_cv_.notify_one();
+  consumer_.join();
+}
+
+inline std::uint64_t compressed_rotating_file_sink_mpsc::next_sink_id_() {
+  static std::atomic<std::uint64_t> last_id{0};
+  return ++last_id;
+}
+
+inline void compressed_rotating_file_sink_mpsc::log(const details::log_msg& msg) {
+  producer_state& producer = producer_();
+  producer.formatted.clear();
+  producer.formatter->format(msg, producer.formatted);
+  publish_(string_view_t(producer.formatted.data(), producer.formatted.size()), msg.time, false, nullptr);
+}
+
+inline void compressed_rotating_file_sink_mpsc::flush() {
+  std::size_t pos;
+  publish_(string_view_t(), log_clock::now(), true, &pos);
+  std::unique_lock<std::mutex> lock(flush_mutex_);
+  flush_cv_.wait(lock, [this, pos] { return flushed_ > pos; });
+}
+
+inline void compressed_rotating_file_sink_mpsc::set_pattern(const std::string& pattern) { set_formatter(details::make_unique<spdlog::pattern_formatter>(pattern)); }
+
+// producers pick up the new formatter on their next record
+inline void compressed_rotating_file_sink_mpsc::set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) {
+  std::lock_guard<std::mutex> lock(formatter_mutex_);
+  formatter_ = std::move(sink_formatter);
+  ++generation_;
+}
+
+// a thread keeps the state of the last few sinks it logged to.
+// ids are never reused, the state of a destroyed sink just ages out.
+inline compressed_rotating_file_sink_mpsc::producer_state& compressed_rotating_file_sink_mpsc::producer_() {
+  static constexpr std::size_t max_sinks_per_thread = 8;
+  thread_local std::vector<std::unique_ptr<producer_state>> states;
+
+  producer_state* state = nullptr;
+  for (auto& s : states) {
+    if (s->sink_id == id_) {
+      state = s.get();
+      break;
+    }
+  }
+  if (state == nullptr) {
+    if (states.size() >= max_sinks_per_thread) {
+      states.erase(states.begin());
+    }
+    states.push_back(details::make_unique<producer_state>());
+    state = states.back().get();
+    state->sink_id = id_;
+  }
+  if (state->generation != generation_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(formatter_mutex_);
+    state->formatter = formatter_->clone();
+    state->generation = generation_.load(std::memory_order_relaxed);
+  }
+  return *state;
+}
+
+inline void compressed_rotating_file_sink_mpsc::publish_(string_view_t formatted, log_clock::time_point time, bool flush, std::size_t* pos) {
+  std::size_t at = ring_.push(formatted, time, flush);
+  if (pos != nullptr) {
+    *pos = at;
+  }
+  // pairs with the fence in wait_for_records_: either the consumer sees the record or we see it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_cv_.notify_one();
+  }
+}
+
+inline void compressed_rotating_file_sink_mpsc::consumer_loop_() {
+  for (;;) {
+    details::mpsc_record_ring::slot* s = ring_.front();
+    if (s == nullptr) {
+      if (stop_) {
+        return;  // the sink is being destroyed, nobody is logging anymore
+      }
+      wait_for_records_();
+      continue;
+    }
+
+    bool flush = s->flush;
+    try {
+      if (flush) {
+        backend_->flush_();
+      } else {
+        backend_->write_formatted_(s->data, s->time);
+      }
+    } catch (const std::exception& ex) {
+      std::fprintf(stderr, "[*** LOG ERROR ***] compressed_rotating_file_sink_mpsc: %s\n", ex.what());
+    } catch (...) {
+      std::fprintf(stderr, "[*** LOG ERROR ***] compressed_rotating_file_sink_mpsc: unknown exception\n");
+    }
+    std::size_t pos = ring_.position();
+    ring_.pop();
+    if (flush) {
+      {
+        std::lock_guard<std::mutex> lock(flush_mutex_);
+        flushed_ = pos + 1;
+      }
+      flush_cv_.notify_all();
+    }
+  }
+}
+
+// spins shortly before sleeping, records usually come in bursts
+inline void compressed_rotating_file_sink_mpsc::wait_for_records_() {
+  for (int i = 0; i < 64; ++i) {
+    if (ring_.front() != nullptr) {
+      return;
+    }
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(wake_mutex_);
+  sleeping_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring_.front() == nullptr && !stop_) {
+    wake_cv_.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  sleeping_.store(false, std::memory_order_relaxed);
+}
+
+}  // namespace sinks
+}  // namespace spdlog
+
+#endif
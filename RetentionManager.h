@@ -0,0 +1,148 @@
+#ifndef RETENTION_MANAGER_H
+#define RETENTION_MANAGER_H
+
+#include <spdlog/common.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <tuple>
+
+namespace spdlog {
+namespace details {
+
+//
+// Disk budget shared by the archives of several sinks.
+// Sinks attach with a callback that deletes one of their archives, and report
+// every archive they create or delete themselves. enforce() evicts the oldest
+// archives across all sinks until the total is within max_bytes and none is
+// older than max_age. It works on what the sinks reported, never on the disk.
+// Archives are identified by owner and tail (".<time><ext>"), which does not
+// change when index mode renames them.
+//
+class retention_manager {
+ public:
+  // deletes the archive with this tail, the owner takes its own archive lock
+  using evict_fn = std::function<void(const filename_t& tail)>;
+
+  // max_bytes 0: no size limit. max_age 0: no age limit
+  explicit retention_manager(std::uint64_t max_bytes, std::chrono::seconds max_age = std::chrono::seconds(0));
+  retention_manager(const retention_manager&) = delete;
+  retention_manager& operator=(const retention_manager&) = delete;
+
+  // returns the owner id for the other calls
+  std::size_t attach(evict_fn evict);
+  // forgets the owner's archives, they stay on disk. waits for a running eviction.
+  void detach(std::size_t owner);
+
+  void added(std::size_t owner, const filename_t& tail, std::uint64_t size, log_clock::time_point time);
+  void removed(std::size_t owner, const filename_t& tail);
+
+  // must not be called with the archive lock of any owner held
+  void enforce(log_clock::time_point now = log_clock::now());
+
+  std::uint64_t total_bytes() const;
+
+ private:
+  struct archive {
+    std::uint64_t size;
+    log_clock::time_point time;
+  };
+  using key_t = std::pair<std::size_t, filename_t>;                 // owner, tail
+  using age_key_t = std::tuple<log_clock::time_point, std::size_t, filename_t>;  // oldest first
+
+  const std::uint64_t max_bytes_;
+  const std::chrono::seconds max_age_;
+  std::mutex evict_mutex_;  // held while calling evict_fn, taken before mutex_
+  mutable std::mutex mutex_;
+  std::size_t last_owner_ = 0;
+  std::map<std::size_t, evict_fn> owners_;
+  std::map<key_t, archive> archives_;
+  std::set<age_key_t> by_age_;
+  std::uint64_t total_bytes_ = 0;
+};
+
+inline retention_manager::retention_manager(std::uint64_t max_bytes, std::chrono::seconds max_age) : max_bytes_(max_bytes), max_age_(max_age) {}
+
+inline std::size_t retention_manager::attach(evict_fn evict) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  owners_.emplace(++last_owner_, std::move(evict));
+  return last_owner_;
+}
+
+inline void retention_manager::detach(std::size_t owner) {
+  std::lock_guard<std::mutex> evict_lock(evict_mutex_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  owners_.erase(owner);
+  auto it = archives_.lower_bound(key_t(owner, filename_t()));
+  while (it != archives_.end() && it->first.first == owner) {
+    total_bytes_ -= it->second.size;
+    by_age_.erase(age_key_t(it->second.time, owner, it->first.second));
+    it = archives_.erase(it);
+  }
+}
+
+inline void retention_manager::added(std::size_t owner, const filename_t& tail, std::uint64_t size, log_clock::time_point time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (archives_.emplace(key_t(owner, tail), archive{size, time}).second) {
+    by_age_.emplace(time, owner, tail);
+    total_bytes_ += size;
+  }
+}
+
+inline void retention_manager::removed(std::size_t owner, const filename_t& tail) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = archives_.find(key_t(owner, tail));
+  if (it != archives_.end()) {
+    total_bytes_ -= it->second.size;
+    by_age_.erase(age_key_t(it->second.time, owner, tail));
+    archives_.erase(it);
+  }
+}
+
+inline void retention_manager::enforce(log_clock::time_point now) {
+  std::lock_guard<std::mutex> evict_lock(evict_mutex_);
+  for (;;) {
+    evict_fn evict;
+    filename_t tail;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (by_age_.empty()) {
+        return;
+      }
+      const age_key_t& oldest = *by_age_.begin();
+      bool over_budget = max_bytes_ > 0 && total_bytes_ > max_bytes_;
+      bool too_old = max_age_.count() > 0 && std::get<0>(oldest) + max_age_ < now;
+      if (!over_budget && !too_old) {
+        return;
+      }
+      std::size_t owner = std::get<1>(oldest);
+      tail = std::get<2>(oldest);
+      auto it = archives_.find(key_t(owner, tail));
+      total_bytes_ -= it->second.size;
+      archives_.erase(it);
+      by_age_.erase(by_age_.begin());
+      auto owner_it = owners_.find(owner);
+      if (owner_it != owners_.end()) {
+        evict = owner_it->second;
+      }
+    }
+    // the owner reports the delete through removed(), which finds nothing left to do
+    if (evict) {
+      evict(tail);
+    }
+  }
+}
+
+inline std::uint64_t retention_manager::total_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_bytes_;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
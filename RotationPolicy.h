@@ -0,0 +1,64 @@
+#ifndef ROTATION_POLICY_H
+#define ROTATION_POLICY_H
+
+#include <spdlog/common.h>
+
+#include <chrono>
+
+namespace spdlog {
+namespace sinks {
+
+// When to rotate besides max_size, whichever comes first.
+// A rotation only happens when a record arrives, so after an idle period the
+// file is closed by the first record of the new one.
+enum class rotation_clock {
+  none,      // size only
+  interval,  // rotation_interval after the last rotation, or after the sink was opened
+  boundary,  // when the wall clock crosses a multiple of rotation_interval since the epoch (UTC), e.g. on the hour for 1h
+};
+
+}  // namespace sinks
+
+namespace details {
+
+//
+// Deadline of the time based rotation. It is computed when a file period
+// starts; the hot path only compares it with log_msg::time, which spdlog
+// already took, so no clock is read per record.
+//
+class rotation_schedule {
+ public:
+  rotation_schedule() = default;
+  rotation_schedule(sinks::rotation_clock clock, std::chrono::seconds interval);
+
+  bool due(log_clock::time_point time) const { return time >= deadline_; }
+  // starts a new period at now
+  void reset(log_clock::time_point now);
+  log_clock::time_point deadline() const { return deadline_; }
+
+ private:
+  sinks::rotation_clock clock_ = sinks::rotation_clock::none;
+  log_clock::duration interval_{0};
+  log_clock::time_point deadline_ = log_clock::time_point::max();
+};
+
+inline rotation_schedule::rotation_schedule(sinks::rotation_clock clock, std::chrono::seconds interval)
+    : clock_(interval.count() > 0 ? clock : sinks::rotation_clock::none), interval_(std::chrono::duration_cast<log_clock::duration>(interval)) {}
+
+inline void rotation_schedule::reset(log_clock::time_point now) {
+  switch (clock_) {
+    case sinks::rotation_clock::interval:
+      deadline_ = now + interval_;
+      break;
+    case sinks::rotation_clock::boundary:
+      deadline_ = log_clock::time_point((now.time_since_epoch() / interval_ + 1) * interval_);
+      break;
+    default:
+      deadline_ = log_clock::time_point::max();
+  }
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
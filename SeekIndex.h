@@ -0,0 +1,165 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace spdlog {
+namespace details {
+
+// One independently decodable frame of a seekable archive.
+struct seek_frame {
+  std::uint64_t offset = 0;  // in the uncompressed log
+  std::uint64_t size = 0;
+  std::uint64_t compressed_offset = 0;
+  std::uint64_t compressed_size = 0;
+  // time of the first and last record, the epoch when not known
+  log_clock::time_point first_time;
+  log_clock::time_point last_time;
+};
+
+using seek_frames = std::vector<seek_frame>;
+
+//
+// Cuts the log written to the active file into frames of about frame_size
+// uncompressed bytes, at record boundaries, and keeps their time range.
+// The compressor later starts a new frame at each boundary. With frame_size 0
+// and time_range, the whole file is one frame, kept only for its size and times.
+//
+class seek_recorder {
+ public:
+  explicit seek_recorder(std::size_t frame_size = 0, bool time_range = false) : frame_size_(frame_size), time_range_(time_range) {}
+
+  bool enabled() const { return frame_size_ > 0; }
+  // records are to be passed to record()
+  bool recording() const { return frame_size_ > 0 || time_range_; }
+  // the next record starts a new frame
+  bool frame_full() const { return frame_size_ > 0 && !frames_.empty() && frames_.back().size >= frame_size_; }
+  // a record of size bytes was appended
+  void record(std::size_t size, log_clock::time_point time);
+  // compressed bytes written for the current frame, when compressing while writing
+  void compressed(std::size_t size);
+  // the current frame was finished early, the next record starts a new one
+  void end_frame() { ended_ = true; }
+
+  // frames of the file so far, the recorder starts over with a file of size bytes of unknown time
+  seek_frames take(std::size_t size = 0);
+
+ private:
+  std::size_t frame_size_;
+  bool time_range_;
+  seek_frames frames_;
+  std::uint64_t offset_ = 0;
+  std::uint64_t compressed_offset_ = 0;
+  bool ended_ = false;
+};
+
+inline void seek_recorder::record(std::size_t size, log_clock::time_point time) {
+  if (frames_.empty() || frame_full() || ended_) {
+    ended_ = false;
+    seek_frame frame;
+    frame.offset = offset_;
+    frame.compressed_offset = compressed_offset_;
+    frame.first_time = time;
+    frames_.push_back(frame);
+  }
+  frames_.back().size += size;
+  frames_.back().last_time = time;
+  offset_ += size;
+}
+
+inline void seek_recorder::compressed(std::size_t size) {
+  if (!frames_.empty()) {
+    frames_.back().compressed_size += size;
+  }
+  compressed_offset_ += size;
+}
+
+inline seek_frames seek_recorder::take(std::size_t size) {
+  seek_frames frames;
+  frames.swap(frames_);
+  offset_ = size;
+  compressed_offset_ = 0;
+  ended_ = false;
+  if (size > 0) {
+    seek_frame unknown;
+    unknown.size = size;
+    frames_.push_back(unknown);
+  }
+  return frames;
+}
+
+// uncompressed size and time range of the frames, times stay the epoch when no frame has them
+inline void frames_span(const seek_frames& frames, std::uint64_t& size, log_clock::time_point& first_time, log_clock::time_point& last_time) {
+  size = 0;
+  for (const auto& f : frames) {
+    size += f.size;
+    if (f.first_time.time_since_epoch().count() != 0) {
+      if (first_time.time_since_epoch().count() == 0 || f.first_time < first_time) {
+        first_time = f.first_time;
+      }
+      last_time = std::max(last_time, f.last_time);
+    }
+  }
+}
+
+// Sidecar of a seekable archive, "<archive>.idx". One line per frame:
+// offset size compressed_offset compressed_size first_time last_time
+// with times in nanoseconds since the epoch, 0 when not known.
+inline bool write_seek_index(const filename_t& filename, const seek_frames& frames) {
+  std::FILE* out = nullptr;
+  if (os::fopen_s(&out, filename, SPDLOG_FILENAME_T("wb"))) {
+    return false;
+  }
+  bool ok = std::fputs("# offset size compressed_offset compressed_size first_time last_time\n", out) >= 0;
+  for (const auto& f : frames) {
+    auto first = std::chrono::duration_cast<std::chrono::nanoseconds>(f.first_time.time_since_epoch()).count();
+    auto last = std::chrono::duration_cast<std::chrono::nanoseconds>(f.last_time.time_since_epoch()).count();
+    ok = std::fprintf(out, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64 "\n", f.offset, f.size, f.compressed_offset, f.compressed_size,
+                      static_cast<std::int64_t>(first), static_cast<std::int64_t>(last)) > 0 &&
+         ok;
+  }
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok) {
+    os::remove(filename);
+  }
+  return ok;
+}
+
+inline bool read_seek_index(const filename_t& filename, seek_frames& frames) {
+  std::FILE* in = nullptr;
+  if (os::fopen_s(&in, filename, SPDLOG_FILENAME_T("rb"))) {
+    return false;
+  }
+  frames.clear();
+  char line[256];
+  while (std::fgets(line, sizeof(line), in) != nullptr) {
+    if (line[0] == '#') {
+      continue;
+    }
+    seek_frame f;
+    std::int64_t first, last;
+    if (std::sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64, &f.offset, &f.size, &f.compressed_offset, &f.compressed_size, &first, &last) != 6) {
+      frames.clear();
+      std::fclose(in);
+      return false;
+    }
+    f.first_time = log_clock::time_point(std::chrono::duration_cast<log_clock::duration>(std::chrono::nanoseconds(first)));
+    f.last_time = log_clock::time_point(std::chrono::duration_cast<log_clock::duration>(std::chrono::nanoseconds(last)));
+    frames.push_back(f);
+  }
+  std::fclose(in);
+  return true;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
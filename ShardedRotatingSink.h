@@ -0,0 +1,142 @@
+#ifndef SHARDED_ROTATING_SINK_H
+#define SHARDED_ROTATING_SINK_H
+
+#include <spdlog/details/null_mutex.h>
+#include <spdlog/pattern_formatter.h>
+#include <spdlog/sinks/sink.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CompressedRotatingSink.h"
+
+namespace spdlog {
+namespace sinks {
+
+//
+// compressed_rotating_file_sink split into shards, for more write bandwidth than
+// one sequential file gets. Each shard is a compressed_rotating_file_sink_st with
+// its own active file, log.s<i>.txt, that rotates and compresses on its own; with
+// shard_dirs, shard i goes to shard_dirs[i % size] (e.g. one per mount point).
+// A logging thread sticks to one shard, threads are spread round robin.
+// With async_compression and no options.worker, the shards share one worker, its
+// queue compression_queue_size per shard; compression_threads spreads the work.
+// options.group_commit is not supported: its sync thread would need the lock of a
+// shard, which this sink holds outside the _st backend. The constructor throws.
+//
+// Every record starts with a 16 hex digit sequence number and a space, taken under
+// the shard's lock, so each shard is in sequence order and merging the shards by it
+// restores the order records were written in. Numbers start at the nanoseconds since
+// the epoch when the sink is created, and keep growing across restarts. With
+// options.binary_records the number is the sequence field of the binary record.
+//
+class compressed_rotating_file_sink_sharded final : public sink {
+ public:
+  compressed_rotating_file_sink_sharded(filename_t base_filename, std::size_t shards, std::size_t max_size, std::size_t max_files, std::size_t max_comp_files,
+                                        bool rotate_on_open = false, compressed_rotating_sink_options options = {}, std::vector<filename_t> shard_dirs = {});
+  compressed_rotating_file_sink_sharded(const compressed_rotating_file_sink_sharded&) = delete;
+  compressed_rotating_file_sink_sharded& operator=(const compressed_rotating_file_sink_sharded&) = delete;
+
+  void log(const details::log_msg& msg) override;
+  void flush() override;
+  void set_pattern(const std::string& pattern) override;
+  void set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) override;
+
+  std::size_t shard_count() const { return shards_.size(); }
+  const filename_t& filename(std::size_t shard) const { return shards_[shard]->backend->filename(); }
+  compressed_rotating_sink_stats stats(std::size_t shard) const { return shards_[shard]->backend->stats(); }
+
+  // log.txt -> log.s<shard>.txt, in dir when not empty
+  static filename_t shard_filename(const filename_t& base_filename, std::size_t shard, const filename_t& dir = {});
+
+ private:
+  struct shard_state {
+    std::mutex mutex;
+    std::unique_ptr<compressed_rotating_file_sink_st> backend;
+    std::unique_ptr<spdlog::formatter> formatter;
+    bool binary = false;  // options.binary_records, until set_formatter()
+    memory_buf_t record;
+  };
+
+  // the calling thread's shard
+  shard_state& shard_();
+
+  std::vector<std::unique_ptr<shard_state>> shards_;
+  std::atomic<std::uint64_t> sequence_;
+};
+
+inline compressed_rotating_file_sink_sharded::compressed_rotating_file_sink_sharded(filename_t base_filename, std::size_t shards, std::size_t max_size, std::size_t max_files,
+                                                                                    std::size_t max_comp_files, bool rotate_on_open, compressed_rotating_sink_options options,
+                                                                                    std::vector<filename_t> shard_dirs)
+    : sequence_(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count())) {
+  if (shards == 0) {
+    SPDLOG_THROW(spdlog_ex("compressed_rotating_file_sink_sharded: shards must be at least 1"));
+  }
+  if (options.group_commit) {
+    SPDLOG_THROW(spdlog_ex("compressed_rotating_file_sink_sharded: options.group_commit is not supported, flush() the sink instead"));
+  }
+  if (options.async_compression && !options.worker) {
+    options.worker = std::make_shared<details::compression_worker>(options.compression_queue_size * shards);
+  }
+  for (std::size_t i = 0; i < shards; ++i) {
+    auto state = details::make_unique<shard_state>();
+    filename_t name = shard_filename(base_filename, i, shard_dirs.empty() ? filename_t() : shard_dirs[i % shard_dirs.size()]);
+    state->backend = details::make_unique<compressed_rotating_file_sink_st>(std::move(name), max_size, max_files, max_comp_files, rotate_on_open, options);
+    state->formatter = details::make_unique<spdlog::pattern_formatter>();
+    state->binary = options.binary_records;
+    shards_.push_back(std::move(state));
+  }
+}
+
+inline filename_t compressed_rotating_file_sink_sharded::shard_filename(const filename_t& base_filename, std::size_t shard, const filename_t& dir) {
+  filename_t parent, filename, basename, ext;
+  details::split_path(base_filename, parent, filename);
+  std::tie(basename, ext) = details::file_helper::split_by_extension(filename);
+  return details::join_path(dir.empty() ? parent : dir, fmt::format(SPDLOG_FILENAME_T("{}.s{}{}"), basename, shard, ext));
+}
+
+inline void compressed_rotating_file_sink_sharded::log(const details::log_msg& msg) {
+  shard_state& shard = shard_();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.record.clear();
+  if (shard.binary) {
+    details::encode_binary_record(msg, shard.record, sequence_.fetch_add(1, std::memory_order_relaxed));
+  } else {
+    fmt::format_to(std::back_inserter(shard.record), "{:016x} ", sequence_.fetch_add(1, std::memory_order_relaxed));
+    shard.formatter->format(msg, shard.record);
+  }
+  shard.backend->write_formatted_(shard.record, msg.time);
+}
+
+inline void compressed_rotating_file_sink_sharded::flush() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->backend->flush_();
+  }
+}
+
+inline void compressed_rotating_file_sink_sharded::set_pattern(const std::string& pattern) { set_formatter(details::make_unique<spdlog::pattern_formatter>(pattern)); }
+
+inline void compressed_rotating_file_sink_sharded::set_formatter(std::unique_ptr<spdlog::formatter> sink_formatter) {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->formatter = sink_formatter->clone();
+    shard->binary = false;
+  }
+}
+
+inline compressed_rotating_file_sink_sharded::shard_state& compressed_rotating_file_sink_sharded::shard_() {
+  static std::atomic<std::size_t> next_thread{0};
+  thread_local std::size_t thread_index = next_thread.fetch_add(1, std::memory_order_relaxed);
+  return *shards_[thread_index % shards_.size()];
+}
+
+}  // namespace sinks
+}  // namespace spdlog
+
+#endif
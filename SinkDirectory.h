@@ -0,0 +1,217 @@
+#ifndef SINK_DIRECTORY_H
+#define SINK_DIRECTORY_H
+
+#include <spdlog/common.h>
+#include <spdlog/details/os.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace spdlog {
+namespace details {
+
+// "logs/log.txt" -> "logs" and "log.txt", "log.txt" -> "" and "log.txt"
+inline void split_path(const filename_t& filename, filename_t& dir, filename_t& name) {
+#ifdef _WIN32
+  auto pos = filename.find_last_of(SPDLOG_FILENAME_T("\\/"));
+#else
+  auto pos = filename.find_last_of('/');
+#endif
+  if (pos == filename_t::npos) {
+    dir.clear();
+    name = filename;
+    return;
+  }
+  dir = filename.substr(0, pos == 0 ? 1 : pos);
+  name = filename.substr(pos + 1);
+}
+
+inline filename_t join_path(const filename_t& dir, const filename_t& name) {
+  if (dir.empty()) {
+    return name;
+  }
+  return dir.back() == '/' ? dir + name : dir + SPDLOG_FILENAME_T("/") + name;
+}
+
+//
+// The directory of a sink's files, held open. On POSIX, files are renamed, removed
+// and looked at relative to the directory descriptor (renameat, unlinkat, fstatat),
+// so the kernel does not resolve the directory path again for each of them, and
+// list() reads the entries from it. Names may be given with the directory prefix
+// the sink builds them with ("logs/log.3.txt"), it is skipped without a copy.
+// Elsewhere the full names go through spdlog::details::os.
+//
+class sink_directory {
+ public:
+  sink_directory() = default;
+  // "" is the current directory. throws if it can not be opened
+  explicit sink_directory(filename_t path);
+  sink_directory(const sink_directory&) = delete;
+  sink_directory& operator=(const sink_directory&) = delete;
+  sink_directory(sink_directory&& other) noexcept { *this = std::move(other); }
+  sink_directory& operator=(sink_directory&& other) noexcept;
+  ~sink_directory();
+
+  const filename_t& path() const { return path_; }
+
+  // replaces to if it exists
+  bool rename(const filename_t& from, const filename_t& to) const;
+  bool remove(const filename_t& name) const;
+  bool exists(const filename_t& name) const;
+  // false if name does not exist
+  bool stat(const filename_t& name, std::uint64_t& size, log_clock::time_point* mtime = nullptr) const;
+  // calls fn with the name of each entry, false if the directory can not be read
+  template <typename Fn>
+  bool list(Fn fn) const;
+
+ private:
+  // name relative to the directory
+  const char* relative_(const filename_t& name) const;
+
+  filename_t path_;
+  filename_t prefix_;  // "<path>/", skipped in names starting with it
+#ifndef _WIN32
+  int fd_ = -1;
+#endif
+};
+
+inline sink_directory::sink_directory(filename_t path) : path_(std::move(path)) {
+  if (!path_.empty()) {
+    prefix_ = path_.back() == '/' ? path_ : path_ + SPDLOG_FILENAME_T("/");
+  }
+#ifndef _WIN32
+  fd_ = ::open(path_.empty() ? "." : path_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd_ < 0) {
+    SPDLOG_THROW(spdlog_ex("sink_directory: failed opening " + os::filename_to_str(path_), errno));
+  }
+#endif
+}
+
+inline sink_directory& sink_directory::operator=(sink_directory&& other) noexcept {
+  if (this != &other) {
+#ifndef _WIN32
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    fd_ = other.fd_;
+    other.fd_ = -1;
+#endif
+    path_ = std::move(other.path_);
+    prefix_ = std::move(other.prefix_);
+  }
+  return *this;
+}
+
+inline sink_directory::~sink_directory() {
+#ifndef _WIN32
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+}
+
+inline const char* sink_directory::relative_(const filename_t& name) const {
+  if (!prefix_.empty() && name.size() > prefix_.size() && name.compare(0, prefix_.size(), prefix_) == 0) {
+    return name.c_str() + prefix_.size();
+  }
+  return name.c_str();
+}
+
+inline bool sink_directory::rename(const filename_t& from, const filename_t& to) const {
+#ifndef _WIN32
+  return ::renameat(fd_, relative_(from), fd_, relative_(to)) == 0;
+#else
+  (void)os::remove(to);  // windows does not replace
+  return os::rename(from, to) == 0;
+#endif
+}
+
+inline bool sink_directory::remove(const filename_t& name) const {
+#ifndef _WIN32
+  return ::unlinkat(fd_, relative_(name), 0) == 0;
+#else
+  return os::remove(name) == 0;
+#endif
+}
+
+inline bool sink_directory::exists(const filename_t& name) const {
+#ifndef _WIN32
+  return ::faccessat(fd_, relative_(name), F_OK, 0) == 0;
+#else
+  return os::path_exists(name);
+#endif
+}
+
+inline bool sink_directory::stat(const filename_t& name, std::uint64_t& size, log_clock::time_point* mtime) const {
+#ifndef _WIN32
+  struct ::stat st;
+  if (::fstatat(fd_, relative_(name), &st, 0) != 0) {
+    return false;
+  }
+#else
+  struct _stat64 st;
+  if (::_stat64(name.c_str(), &st) != 0) {
+    return false;
+  }
+#endif
+  size = static_cast<std::uint64_t>(st.st_size);
+  if (mtime != nullptr) {
+    *mtime = log_clock::from_time_t(st.st_mtime);
+  }
+  return true;
+}
+
+template <typename Fn>
+inline bool sink_directory::list(Fn fn) const {
+#ifndef _WIN32
+  int fd = ::openat(fd_, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);  // an offset of its own, closedir() closes it
+  DIR* dir = fd >= 0 ? ::fdopendir(fd) : nullptr;
+  if (dir == nullptr) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  while (const dirent* entry = ::readdir(dir)) {
+    if (entry->d_name[0] != '.' || (entry->d_name[1] != '\0' && (entry->d_name[1] != '.' || entry->d_name[2] != '\0'))) {
+      fn(entry->d_name);
+    }
+  }
+  ::closedir(dir);
+  return true;
+#else
+  _finddata_t data;
+  intptr_t handle = ::_findfirst(join_path(path_.empty() ? filename_t(".") : path_, "*").c_str(), &data);
+  if (handle == -1) {
+    return errno == ENOENT;
+  }
+  do {
+    if (std::strcmp(data.name, ".") != 0 && std::strcmp(data.name, "..") != 0) {
+      fn(static_cast<const char*>(data.name));
+    }
+  } while (::_findnext(handle, &data) == 0);
+  ::_findclose(handle);
+  return true;
+#endif
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SINK_POLICY_H
+#define SINK_POLICY_H
+
+#include <spdlog/common.h>
+
+#include <memory>
+
+#include "CompressionCodec.h"
+
+namespace spdlog {
+namespace sinks {
+
+//
+// Compile-time configuration of compressed_rotating_file_sink<Mutex, Policy>.
+// Each flag allows a group of compressed_rotating_sink_options. A policy that
+// turns one off makes its branches constant, so the compiler drops them from
+// the hot path, and the constructor rejects options that need it.
+// codec_type is the codec class the sink holds: with a final codec class
+// (e.g. details::zstd_codec) its calls are direct, and options.codec has to be
+// one (or unset, for a default constructed one).
+//
+struct dynamic_sink_policy {
+  using codec_type = details::compression_codec;
+  static constexpr bool compression = true;    // archive rotated files, else delete them as rotating_file_sink does
+  static constexpr bool streaming = true;      // options.streaming
+  static constexpr bool time_rotation = true;  // options.rotation
+  static constexpr bool write_blocks = true;   // options.write_block_size
+  static constexpr bool io_policies = true;    // options.io_policy other than buffered
+  static constexpr bool seekable = true;       // options.seek_frame_size
+  static constexpr bool stats = true;          // stats() counters and latencies, zeros when off
+};
+
+// size based rotation and compressed archives, records written as they come
+struct size_only_sink_policy : dynamic_sink_policy {
+  static constexpr bool streaming = false;
+  static constexpr bool time_rotation = false;
+  static constexpr bool write_blocks = false;
+  static constexpr bool io_policies = false;
+  static constexpr bool seekable = false;
+};
+
+// size_only_sink_policy without compression: log.<max_files>.txt is deleted instead
+struct uncompressed_sink_policy : size_only_sink_policy {
+  static constexpr bool compression = false;
+};
+
+}  // namespace sinks
+
+namespace details {
+
+// options.codec as the policy's codec_type, a default constructed one when not set
+template <typename Codec>
+struct policy_codec {
+  static std::shared_ptr<Codec> make(const std::shared_ptr<compression_codec>& codec) {
+    if (!codec) {
+      return std::make_shared<Codec>();
+    }
+    auto typed = std::dynamic_pointer_cast<Codec>(codec);
+    if (!typed) {
+      SPDLOG_THROW(spdlog_ex("compressed_rotating_file_sink: options.codec is not the codec_type of the policy"));
+    }
+    return typed;
+  }
+};
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef SINK_STATS_H
+#define SINK_STATS_H
+
+#include <spdlog/common.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace spdlog {
+namespace sinks {
+
+// Durations in log2 buckets: bucket i counts durations below 2^(i+1) ns.
+struct latency_stats {
+  static constexpr std::size_t bucket_count = 40;
+
+  std::uint64_t count = 0;
+  std::uint64_t sum_ns = 0;
+  std::uint64_t max_ns = 0;
+  std::array<std::uint64_t, bucket_count> buckets{};
+
+  // upper bound of the bucket holding quantile q (0..1), 0 when empty
+  std::uint64_t quantile_ns(double q) const {
+    std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+        return std::uint64_t(1) << (i + 1);
+      }
+    }
+    return max_ns;
+  }
+};
+
+// Snapshot of compressed_rotating_file_sink::stats(). Counters only grow.
+struct compressed_rotating_sink_stats {
+  std::uint64_t records = 0;
+  std::uint64_t bytes_logged = 0;   // formatted
+  std::uint64_t bytes_written = 0;  // to the active file, compressed in streaming mode
+  std::uint64_t rotations = 0;
+  std::uint64_t rename_retries = 0;   // failed renames, retried after a backoff
+  std::uint64_t rename_failures = 0;  // archives given up and left for the next open
+  std::uint64_t compressions = 0;
+  std::uint64_t compression_failures = 0;  // failed attempts, retried like renames
+  std::uint64_t compression_bytes_in = 0;  // sizes of the rotated files compressed, 0 in streaming mode
+  std::uint64_t compression_bytes_out = 0;
+  std::uint64_t recompressions = 0;  // improvable archives compressed again when idle
+  std::uint64_t dropped_files = 0;  // rotated files deleted because the compression queue was full
+  std::uint64_t dropped_bytes = 0;
+  std::uint64_t pending_jobs = 0;   // queued on the compression worker (gauge)
+  latency_stats writes;             // only with options.write_latency_stats
+  latency_stats rotation;
+  latency_stats compression;
+};
+
+}  // namespace sinks
+
+namespace details {
+
+class latency_histogram {
+ public:
+  void record(std::chrono::nanoseconds duration) {
+    auto ns = static_cast<std::uint64_t>(duration.count() > 0 ? duration.count() : 0);
+    std::size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (std::uint64_t(1) << (bucket + 1)) <= ns) {
+      ++bucket;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+    std::uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  sinks::latency_stats snapshot() const {
+    sinks::latency_stats stats;
+    stats.count = count_.load(std::memory_order_relaxed);
+    stats.sum_ns = sum_.load(std::memory_order_relaxed);
+    stats.max_ns = max_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < buckets_.size(); ++i) {
+      stats.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+ private:
+  std::array<std::atomic<std::uint64_t>, sinks::latency_stats::bucket_count> buckets_{};
+  std::atomic<std::uint64_t> count_{0};
+  std::atomic<std::uint64_t> sum_{0};
+  std::atomic<std::uint64_t> max_{0};
+};
+
+// records the time until the end of the scope, nothing when not Enabled
+template <bool Enabled = true>
+class scoped_latency {
+ public:
+  explicit scoped_latency(latency_histogram& histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  scoped_latency(const scoped_latency&) = delete;
+  scoped_latency& operator=(const scoped_latency&) = delete;
+  ~scoped_latency() { histogram_.record(std::chrono::steady_clock::now() - start_); }
+
+ private:
+  latency_histogram& histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+template <>
+class scoped_latency<false> {
+ public:
+  explicit scoped_latency(latency_histogram&) {}
+  scoped_latency(const scoped_latency&) = delete;
+  scoped_latency& operator=(const scoped_latency&) = delete;
+};
+
+//
+// Live counters behind compressed_rotating_sink_stats. Updated with relaxed
+// atomics from the logging thread and the compression worker, read from any
+// thread without taking the sink's lock.
+//
+struct sink_metrics {
+  using counter = std::atomic<std::uint64_t>;
+
+  counter records{0};
+  counter bytes_logged{0};
+  counter bytes_written{0};
+  counter rotations{0};
+  counter rename_retries{0};
+  counter rename_failures{0};
+  counter compressions{0};
+  counter compression_failures{0};
+  counter compression_bytes_in{0};
+  counter compression_bytes_out{0};
+  counter recompressions{0};
+  counter dropped_files{0};
+  counter dropped_bytes{0};
+  counter pending_jobs{0};
+  latency_histogram writes;
+  latency_histogram rotation;
+  latency_histogram compression;
+
+  static void add(counter& c, std::uint64_t n = 1) { c.fetch_add(n, std::memory_order_relaxed); }
+  static void sub(counter& c, std::uint64_t n = 1) { c.fetch_sub(n, std::memory_order_relaxed); }
+
+  sinks::compressed_rotating_sink_stats snapshot() const {
+    sinks::compressed_rotating_sink_stats stats;
+    stats.records = records.load(std::memory_order_relaxed);
+    stats.bytes_logged = bytes_logged.load(std::memory_order_relaxed);
+    stats.bytes_written = bytes_written.load(std::memory_order_relaxed);
+    stats.rotations = rotations.load(std::memory_order_relaxed);
+    stats.rename_retries = rename_retries.load(std::memory_order_relaxed);
+    stats.rename_failures = rename_failures.load(std::memory_order_relaxed);
+    stats.compressions = compressions.load(std::memory_order_relaxed);
+    stats.compression_failures = compression_failures.load(std::memory_order_relaxed);
+    stats.compression_bytes_in = compression_bytes_in.load(std::memory_order_relaxed);
+    stats.compression_bytes_out = compression_bytes_out.load(std::memory_order_relaxed);
+    stats.recompressions = recompressions.load(std::memory_order_relaxed);
+    stats.dropped_files = dropped_files.load(std::memory_order_relaxed);
+    stats.dropped_bytes = dropped_bytes.load(std::memory_order_relaxed);
+    stats.pending_jobs = pending_jobs.load(std::memory_order_relaxed);
+    stats.writes = writes.snapshot();
+    stats.rotation = rotation.snapshot();
+    stats.compression = compression.snapshot();
+    return stats;
+  }
+};
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
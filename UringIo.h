@@ -0,0 +1,309 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#if defined(COMPRESSED_SINK_USE_IO_URING) && defined(__linux__)
+
+#include <spdlog/common.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace spdlog {
+namespace details {
+
+//
+// Writes a file through an io_uring, without liburing: records are gathered into
+// one of depth buffers of buffer_size bytes, and a full buffer is submitted as one
+// write at its file offset, to be done by the kernel's workers while the caller
+// goes on with the next buffer. The caller only waits when every buffer is in
+// flight, or in drain(). With max_age, a buffer is also submitted part full by the
+// first write that finds its oldest bytes max_age old, so that a crash of the process
+// loses less than a whole buffer; records that no write follows wait for drain().
+// A write that fails or comes back short, or that the ring does not take, is
+// finished with pwrite. Offsets are explicit, so the descriptor must not be O_APPEND.
+// Only writes go through the ring: the sink's renames, unlinks and syncs stay
+// synchronous calls (no IORING_OP_RENAMEAT, which needs 5.11, nor IORING_OP_FSYNC).
+//
+class uring_writer {
+ public:
+  uring_writer(std::size_t depth, std::size_t buffer_size, std::chrono::milliseconds max_age = std::chrono::milliseconds(0));
+  uring_writer(const uring_writer&) = delete;
+  uring_writer& operator=(const uring_writer&) = delete;
+  ~uring_writer();
+
+  // false when the kernel has no io_uring (or it is not allowed), use something else
+  bool ok() const { return ring_fd_ >= 0; }
+  // writes go to fd from offset on, after drain() of the previous one
+  void open(int fd, std::uint64_t offset);
+  bool write(const char* data, std::size_t size);
+  // submits what is buffered and waits for every write, false if one failed
+  bool drain();
+
+ private:
+  struct buffer {
+    std::unique_ptr<char[]> data;
+    std::size_t size = 0;
+    std::uint64_t offset = 0;
+    bool in_flight = false;
+  };
+
+  // a buffer the ring does not take is written on the calling thread, and failed_ is set
+  void submit_(std::size_t index);
+  // submits the current buffer and waits until the next one is free
+  bool next_();
+  // handles the completions there are, waiting for one first if asked to
+  bool reap_(bool wait);
+  bool complete_(buffer& b, int res);
+
+  int ring_fd_ = -1;
+  bool async_ = false;  // IOSQE_ASYNC: the kernel never writes on the submitting thread
+  void* sq_ptr_ = nullptr;
+  std::size_t sq_size_ = 0;
+  void* cq_ptr_ = nullptr;
+  std::size_t cq_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+
+  std::vector<buffer> buffers_;
+  std::size_t buffer_size_;
+  std::chrono::milliseconds max_age_;
+  std::chrono::steady_clock::time_point oldest_;  // first write into the current buffer
+  std::size_t current_ = 0;
+  std::size_t in_flight_ = 0;
+  int fd_ = -1;
+  std::uint64_t offset_ = 0;  // of the end of the current buffer
+  bool failed_ = false;
+};
+
+inline uring_writer::uring_writer(std::size_t depth, std::size_t buffer_size, std::chrono::milliseconds max_age)
+    : buffers_(depth > 1 ? depth : 2), buffer_size_(buffer_size), max_age_(max_age) {
+  io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+  int fd = static_cast<int>(::syscall(__NR_io_uring_setup, static_cast<unsigned>(buffers_.size()), &p));
+  if (fd < 0) {
+    return;
+  }
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  cq_ptr_ = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr_ : ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sq_ptr_ != MAP_FAILED) {
+      ::munmap(sq_ptr_, sq_size_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      ::munmap(cq_ptr_, cq_size_);
+    }
+    if (sqes != MAP_FAILED) {
+      ::munmap(sqes, sqes_size_);
+    }
+    sq_ptr_ = cq_ptr_ = nullptr;
+    ::close(fd);
+    return;
+  }
+  char* sq = static_cast<char*>(sq_ptr_);
+  char* cq = static_cast<char*>(cq_ptr_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+#ifdef IORING_FEAT_FAST_POLL
+  async_ = (p.features & IORING_FEAT_FAST_POLL) != 0;  // 5.7, IOSQE_ASYNC came with 5.6
+#endif
+  for (auto& b : buffers_) {
+    b.data.reset(new char[buffer_size_]);
+  }
+  ring_fd_ = fd;
+}
+
+inline uring_writer::~uring_writer() {
+  if (ring_fd_ < 0) {
+    return;
+  }
+  drain();
+  ::munmap(sqes_, sqes_size_);
+  if (cq_ptr_ != sq_ptr_) {
+    ::munmap(cq_ptr_, cq_size_);
+  }
+  ::munmap(sq_ptr_, sq_size_);
+  ::close(ring_fd_);
+}
+
+inline void uring_writer::open(int fd, std::uint64_t offset) {
+  fd_ = fd;
+  offset_ = offset;
+  buffers_[current_].size = 0;
+  buffers_[current_].offset = offset;
+  failed_ = false;
+}
+
+inline bool uring_writer::write(const char* data, std::size_t size) {
+  bool timed = max_age_.count() > 0;
+  auto now = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  while (size > 0) {
+    buffer& b = buffers_[current_];
+    if (b.size == 0) {
+      oldest_ = now;
+    }
+    std::size_t n = std::min(size, buffer_size_ - b.size);
+    std::memcpy(b.data.get() + b.size, data, n);
+    b.size += n;
+    offset_ += n;
+    data += n;
+    size -= n;
+    if (b.size == buffer_size_ && !next_()) {
+      return false;
+    }
+  }
+  if (timed && buffers_[current_].size > 0 && now - oldest_ >= max_age_ && !next_()) {
+    return false;
+  }
+  return reap_(false) && !failed_;
+}
+
+inline bool uring_writer::next_() {
+  submit_(current_);
+  current_ = (current_ + 1) % buffers_.size();
+  while (buffers_[current_].in_flight) {
+    if (!reap_(true)) {
+      return false;
+    }
+  }
+  buffers_[current_].size = 0;
+  buffers_[current_].offset = offset_;
+  return true;
+}
+
+inline bool uring_writer::drain() {
+  buffer& b = buffers_[current_];
+  if (b.size > 0) {
+    submit_(current_);
+    current_ = (current_ + 1) % buffers_.size();
+  }
+  while (in_flight_ > 0) {
+    if (!reap_(true)) {
+      return false;
+    }
+  }
+  buffers_[current_].size = 0;
+  buffers_[current_].offset = offset_;
+  bool ok = !failed_;
+  failed_ = false;
+  return ok;
+}
+
+inline void uring_writer::submit_(std::size_t index) {
+  buffer& b = buffers_[index];
+  unsigned tail = *sq_tail_;  // only this thread submits
+  unsigned slot = tail & *sq_mask_;
+  io_uring_sqe& sqe = sqes_[slot];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_WRITE;
+  sqe.fd = fd_;
+  sqe.addr = reinterpret_cast<std::uint64_t>(b.data.get());
+  sqe.len = static_cast<std::uint32_t>(b.size);
+  sqe.off = b.offset;
+  sqe.user_data = index;
+  if (async_) {
+    sqe.flags = IOSQE_ASYNC;
+  }
+  sq_array_[slot] = slot;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  b.in_flight = true;
+  ++in_flight_;
+  for (;;) {
+    long n = ::syscall(__NR_io_uring_enter, ring_fd_, 1u, 0u, 0u, nullptr, 0);
+    if (n >= 0) {
+      return;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      break;
+    }
+    reap_(errno != EINTR);
+  }
+  // the kernel did not take the entry: left in the ring it would never complete, and
+  // drain() would wait for it forever
+  int error = errno;
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+  b.in_flight = false;
+  --in_flight_;
+  complete_(b, 0);
+  failed_ = true;
+  errno = error;
+}
+
+inline bool uring_writer::reap_(bool wait) {
+  unsigned head = *cq_head_;
+  if (wait && head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) && in_flight_ > 0) {
+    long n = ::syscall(__NR_io_uring_enter, ring_fd_, 0u, 1u, static_cast<unsigned>(IORING_ENTER_GETEVENTS), nullptr, 0);
+    if (n < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+    buffer& b = buffers_[cqe.user_data];
+    int res = cqe.res;
+    ++head;
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    b.in_flight = false;
+    --in_flight_;
+    if (!complete_(b, res)) {
+      failed_ = true;
+    }
+  }
+  return true;
+}
+
+// finishes a failed or short write on the calling thread
+inline bool uring_writer::complete_(buffer& b, int res) {
+  if (res == -EINVAL && async_) {
+    async_ = false;  // IOSQE_ASYNC unknown to this kernel
+  }
+  std::size_t done = res > 0 ? static_cast<std::size_t>(res) : 0;
+  while (done < b.size) {
+    ssize_t n = ::pwrite(fd_, b.data.get() + done, b.size - done, static_cast<off_t>(b.offset + done));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+}  // namespace details
+}  // namespace spdlog
+
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Helpers shared by the bench programs.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace bench {
+
+using bench_clock = std::chrono::steady_clock;
+
+// log2 buckets of nanoseconds
+class histogram {
+ public:
+  void add(std::uint64_t ns) {
+    std::size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (std::uint64_t(1) << (bucket + 1)) <= ns) {
+      ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    max_ = std::max(max_, ns);
+  }
+  void merge(const histogram& other) {
+    for (std::size_t i = 0; i < buckets_.size(); ++i) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+  // upper bound of the bucket holding the quantile
+  std::uint64_t quantile(double q) const {
+    std::uint64_t rank = static_cast<std::uint64_t>(q * static_cast<double>(count_));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets_.size(); ++i) {
+      seen += buckets_[i];
+      if (seen > rank) {
+        return std::uint64_t(1) << (i + 1);
+      }
+    }
+    return max_;
+  }
+  std::uint64_t count() const { return count_; }
+  std::uint64_t max() const { return max_; }
+
+ private:
+  std::array<std::uint64_t, 48> buckets_{};
+  std::uint64_t count_ = 0;
+  std::uint64_t max_ = 0;
+};
+
+inline std::uint64_t elapsed_ns(bench_clock::time_point start) {
+  return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+}
+
+inline void reset_dir(const std::string& dir) {
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+}
+
+}  // namespace bench
+
+#endif
@@ -0,0 +1,538 @@
+//
+// Soak test for compressed_rotating_file_sink_mt: logging threads drive a sink with
+// a tiny max_size, so that it rotates thousands of times per second, for as long as
+// asked. Every report interval it prints throughput, per call latency, rotations,
+// the compression backlog and the number of open descriptors.
+// With --restarts N the sink is destroyed and opened again N times during the run,
+// and --fail-renames PERCENT (Linux) makes that share of the renames of the process
+// fail, as an antivirus scanner holding the files would. --abandon skips the queued
+// compressions at each restart, leaving their files for the next opening to archive.
+// With either, the sink is then opened a last time with renames working, to archive
+// what is left. --file names the active file, "log" checks names without extension.
+// --ship deletes each archive in archive_callback, as a shipper done uploading would.
+// --codec adaptive is gzip between levels 1 and 9, storing when the backlog is saturated.
+// At the end it checks the archive set:
+//   events   archives reported through archive_callback come in rotation order for
+//            each opening of the sink, with no number (sequence naming) or stamp
+//            (index naming) twice, and sequence numbers skipped only for files
+//            dropped by a full queue (with --fail-renames or --abandon, archives that
+//            failed or were skipped come later, out of order, and may skip numbers)
+//   files    the archives (unless shipped) and rotated files left in the directory are numbered
+//            without duplicates, and without gaps unless renames failed or jobs were
+//            abandoned, none higher than the rotations and archives could have taken
+//            (a stamp read as a number), and at most max_comp_files are kept
+//   staged   no file set aside by a rotation is left over
+//   decode   the archives left decode, recompressed ones included (codecs that decode)
+//   bytes    every byte logged is in an archive, a rotated file or the active file,
+//            or was counted as dropped (not checked in streaming mode)
+//   durable  with --group-commit, wait_durable() returns true after records logged
+//            at the end of each opening (a wait that does not return within 10 s
+//            ends the run)
+//   fds      the process has as many descriptors open as before the sink
+// and exits with 1 if one fails.
+//
+// Build from the repository root, as the bench:
+//   g++ -std=c++17 -O2 -I. bench/CompressedRotatingSinkSoak.cpp -o sink_soak -lspdlog -lfmt -pthread -ldl
+// Run:
+//   ./sink_soak [--dir DIR] [--file NAME] [--seconds N] [--report N] [--threads N] [--max-size BYTES]
+//               [--max-files N] [--max-comp-files N] [--size fixed:N|uniform:MIN:MAX|lognormal:MEDIAN]
+//               [--codec gzip|zstd|lz4|adaptive] [--async] [--sequence] [--streaming] [--preallocate]
+//               [--discard] [--binary] [--queue N] [--pool N] [--restarts N] [--fail-renames PERCENT]
+//               [--group-commit] [--abandon] [--ship]
+//
+#include <spdlog/details/log_msg.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "CompressedRotatingSink.h"
+
+#ifdef __linux__
+#include <dlfcn.h>
+
+#include <cerrno>
+
+// renames of the process that fail, in percent
+static std::atomic<unsigned> rename_failure_percent{0};
+
+// sink_directory renames through renameat: this one is taken before the libc one
+extern "C" int renameat(int old_dir, const char* old_path, int new_dir, const char* new_path) noexcept {
+  using renameat_fn = int (*)(int, const char*, int, const char*);
+  static renameat_fn real = reinterpret_cast<renameat_fn>(dlsym(RTLD_NEXT, "renameat"));
+  thread_local std::minstd_rand rng(static_cast<unsigned>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+  unsigned percent = rename_failure_percent.load(std::memory_order_relaxed);
+  if (percent > 0 && rng() % 100 < percent) {
+    errno = EACCES;
+    return -1;
+  }
+  return real(old_dir, old_path, new_dir, new_path);
+}
+#endif
+
+namespace {
+
+using bench::bench_clock;
+using bench::elapsed_ns;
+using bench::histogram;
+using spdlog::sinks::compressed_rotating_sink_options;
+
+struct config {
+  std::string dir = "sink_soak_logs";
+  std::string file = "log.txt";  // e.g. "log" for names without extension
+  std::size_t seconds = 60;
+  std::size_t report = 10;
+  std::size_t threads = 4;
+  std::size_t max_size = 64 * 1024;
+  std::size_t max_files = 4;
+  std::size_t max_comp_files = 1000;
+  std::string size = "lognormal:120";
+  std::size_t restarts = 0;
+  unsigned fail_renames = 0;
+  bool ship = false;
+  compressed_rotating_sink_options options;
+};
+
+// record sizes drawn per thread
+class size_distribution {
+ public:
+  static constexpr std::size_t max_size = 16 * 1024;
+
+  explicit size_distribution(const std::string& spec) {
+    char kind[16] = {};
+    unsigned long long a = 0, b = 0;
+    int n = std::sscanf(spec.c_str(), "%15[a-z]:%llu:%llu", kind, &a, &b);
+    kind_ = kind;
+    a_ = static_cast<std::size_t>(a);
+    b_ = static_cast<std::size_t>(n == 3 ? b : a);
+    if (n < 2 || a_ == 0 || b_ < a_ || (kind_ != "fixed" && kind_ != "uniform" && kind_ != "lognormal")) {
+      std::fprintf(stderr, "bad --size %s\n", spec.c_str());
+      std::exit(2);
+    }
+  }
+
+  std::size_t operator()(std::mt19937_64& rng) const {
+    double size;
+    if (kind_ == "fixed") {
+      size = static_cast<double>(a_);
+    } else if (kind_ == "uniform") {
+      size = static_cast<double>(std::uniform_int_distribution<std::size_t>(a_, b_)(rng));
+    } else {
+      size = std::lognormal_distribution<double>(std::log(static_cast<double>(a_)), 1.0)(rng);
+    }
+    return static_cast<std::size_t>(std::min(std::max(size, 1.0), static_cast<double>(max_size)));
+  }
+
+ private:
+  std::string kind_;
+  std::size_t a_ = 0;
+  std::size_t b_ = 0;
+};
+
+// archives as archive_callback reports them, in the order they were finished
+class event_checker {
+ public:
+  explicit event_checker(bool sequence) : sequence_(sequence) {}
+
+  // a new sink, which first archives what the last one left
+  void reopened() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    opened_events_ = 0;
+  }
+
+  void add(const spdlog::sinks::archive_event& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++events_;
+    ++opened_events_;
+    bytes_in_ += event.bytes_in;
+    bytes_out_ += event.bytes_out;
+    if (sequence_) {
+      if (opened_events_ > 1 && event.number <= last_number_) {
+        ++out_of_order_;
+      } else if (opened_events_ > 1) {
+        skipped_ += event.number - last_number_ - 1;
+      }
+      last_number_ = event.number;
+    } else if (opened_events_ > 1 && event.rotation_time <= last_time_) {
+      ++out_of_order_;  // stamps are unique and grow with each rotation
+    }
+    last_time_ = event.rotation_time;
+  }
+
+  std::uint64_t events() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+  }
+  std::uint64_t bytes_in() const { return bytes_in_; }
+  std::uint64_t bytes_out() const { return bytes_out_; }
+  std::uint64_t out_of_order() const { return out_of_order_; }
+  std::uint64_t skipped() const { return skipped_; }
+
+ private:
+  mutable std::mutex mutex_;
+  bool sequence_;
+  std::uint64_t events_ = 0;
+  std::uint64_t opened_events_ = 0;
+  std::uint64_t bytes_in_ = 0;
+  std::uint64_t bytes_out_ = 0;
+  std::uint64_t out_of_order_ = 0;
+  std::uint64_t skipped_ = 0;
+  std::size_t last_number_ = 0;
+  spdlog::log_clock::time_point last_time_;
+};
+
+// open descriptors of the process, -1 where /proc/self/fd is not there
+long open_fds() {
+  std::error_code ec;
+  long count = 0;
+  for (std::filesystem::directory_iterator it("/proc/self/fd", ec), end; !ec && it != end; it.increment(ec)) {
+    ++count;
+  }
+  return ec ? -1 : count - 1;  // the iterator's own
+}
+
+bool contiguous(std::vector<std::size_t> numbers, std::size_t& gaps, std::size_t& duplicates) {
+  std::sort(numbers.begin(), numbers.end());
+  gaps = duplicates = 0;
+  for (std::size_t i = 1; i < numbers.size(); ++i) {
+    if (numbers[i] == numbers[i - 1]) {
+      ++duplicates;
+    } else {
+      gaps += numbers[i] - numbers[i - 1] - 1;
+    }
+  }
+  return gaps == 0 && duplicates == 0;
+}
+
+bool check(const char* what, bool ok, const std::string& detail) {
+  std::printf("%-7s %s  %s\n", what, ok ? "ok  " : "FAIL", detail.c_str());
+  return ok;
+}
+
+// the counters the checks need, over all openings of the sink
+void add_stats(spdlog::sinks::compressed_rotating_sink_stats& total, const spdlog::sinks::compressed_rotating_sink_stats& stats) {
+  total.records += stats.records;
+  total.bytes_logged += stats.bytes_logged;
+  total.rotations += stats.rotations;
+  total.rename_retries += stats.rename_retries;
+  total.rename_failures += stats.rename_failures;
+  total.recompressions += stats.recompressions;
+  total.dropped_files += stats.dropped_files;
+  total.dropped_bytes += stats.dropped_bytes;
+}
+
+void log_loop(spdlog::sinks::compressed_rotating_file_sink_mt& sink, std::size_t thread, const size_distribution& sizes, const std::string& payload,
+              const std::atomic<bool>& stop, std::mutex& merge_mutex, histogram& interval) {
+  std::mt19937_64 rng(thread * 7919 + 1);
+  spdlog::memory_buf_t text;
+  histogram local;
+  for (std::uint64_t n = 0; !stop.load(std::memory_order_relaxed); ++n) {
+    std::size_t size = sizes(rng);
+    text.clear();
+    fmt::format_to(std::back_inserter(text), "t{} n{} ", thread, n);
+    std::size_t offset = static_cast<std::size_t>(rng() % (payload.size() - size + 1));
+    text.append(payload.data() + offset, payload.data() + offset + size);
+    spdlog::details::log_msg msg("soak", spdlog::level::info, spdlog::string_view_t(text.data(), text.size()));
+    auto start = bench_clock::now();
+    sink.log(msg);
+    local.add(elapsed_ns(start));
+    if (local.count() == 1024) {
+      std::lock_guard<std::mutex> lock(merge_mutex);
+      interval.merge(local);
+      local = histogram();
+    }
+  }
+  std::lock_guard<std::mutex> lock(merge_mutex);
+  interval.merge(local);
+}
+
+// logs a few records and waits for them to be durable, a few times over: the first
+// wait may be covered by a sync of the records before. false if a sync failed
+bool probe_durable(spdlog::sinks::compressed_rotating_file_sink_mt& sink) {
+  bool synced = true;
+  for (int round = 0; round < 3; ++round) {
+    for (int n = 0; n < 3; ++n) {
+      spdlog::details::log_msg msg("soak", spdlog::level::info, "durable probe");
+      sink.log(msg);
+    }
+    auto waited = std::async(std::launch::async, [&sink] { return sink.wait_durable(); });
+    if (waited.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+      check("durable", false, "wait_durable() did not return within 10 s");
+      std::fflush(stdout);
+      std::_Exit(1);
+    }
+    synced &= waited.get();
+  }
+  return synced;
+}
+
+int run(const config& cfg) {
+  size_distribution sizes(cfg.size);
+  bench::reset_dir(cfg.dir);
+  const bool sequence = cfg.options.naming == spdlog::sinks::archive_naming::sequence;
+  const bool streaming = cfg.options.streaming;
+  std::string payload(2 * size_distribution::max_size, ' ');
+  std::mt19937_64 rng(42);
+  for (auto& c : payload) {
+    c = static_cast<char>('!' + rng() % 94);
+  }
+
+  long fds_before = open_fds();
+  event_checker events(sequence);
+  compressed_rotating_sink_options options = cfg.options;
+  options.archive_callback = [&events, &cfg](const spdlog::sinks::archive_event& event) {
+    events.add(event);
+    if (cfg.ship) {
+      std::remove(event.filename.c_str());
+      std::remove((event.filename + ".idx").c_str());
+    }
+  };
+  auto open_sink = [&] {
+    events.reopened();
+    return std::make_shared<spdlog::sinks::compressed_rotating_file_sink_mt>(cfg.dir + "/" + cfg.file, cfg.max_size, cfg.max_files, cfg.max_comp_files, false, options);
+  };
+  std::printf("== soak: %zu threads, max_size=%zu max_files=%zu max_comp_files=%zu size=%s%s%s%s, %zu s, %zu restarts, %u%% of renames failing\n", cfg.threads, cfg.max_size,
+              cfg.max_files, cfg.max_comp_files, cfg.size.c_str(), options.async_compression ? " async" : "", sequence ? " sequence" : "", streaming ? " streaming" : "", cfg.seconds,
+              cfg.restarts, cfg.fail_renames);
+
+#ifdef __linux__
+  rename_failure_percent = cfg.fail_renames;
+#endif
+  auto start = bench_clock::now();
+  auto last = start;
+  histogram all;
+  long max_fds = fds_before;
+  spdlog::sinks::compressed_rotating_sink_stats stats;
+  std::size_t elapsed = 0;
+  std::size_t probes = 0, probes_failed = 0;
+  for (std::size_t opening = 0; opening <= cfg.restarts; ++opening) {
+    auto sink = open_sink();
+    std::atomic<bool> stop{false};
+    std::mutex merge_mutex;
+    histogram interval;
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < cfg.threads; ++t) {
+      threads.emplace_back([&, t] { log_loop(*sink, t, sizes, payload, stop, merge_mutex, interval); });
+    }
+
+    auto previous = sink->stats();
+    std::size_t until = cfg.seconds * (opening + 1) / (cfg.restarts + 1);
+    while (elapsed < until) {
+      std::size_t step = std::min(cfg.report, until - elapsed);
+      std::this_thread::sleep_until(start + std::chrono::seconds(elapsed + step));
+      elapsed += step;
+      histogram h;
+      {
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        std::swap(h, interval);
+      }
+      all.merge(h);
+      auto now = bench_clock::now();
+      double seconds = std::chrono::duration<double>(now - last).count();
+      last = now;
+      auto current = sink->stats();
+      long fds = open_fds();
+      max_fds = std::max(max_fds, fds);
+      std::printf("[%6zus] %10.0f msgs/s %7.1f MB/s  p50<%6llu p99<%8llu p99.9<%9llu max=%10llu ns  %7.0f rot/s  archives=%-8llu pending=%-4llu dropped=%-6llu retries=%-4llu fds=%ld\n",
+                  elapsed, static_cast<double>(current.records - previous.records) / seconds, static_cast<double>(current.bytes_logged - previous.bytes_logged) / 1e6 / seconds,
+                  static_cast<unsigned long long>(h.quantile(0.5)), static_cast<unsigned long long>(h.quantile(0.99)), static_cast<unsigned long long>(h.quantile(0.999)),
+                  static_cast<unsigned long long>(h.max()), static_cast<double>(current.rotations - previous.rotations) / seconds, static_cast<unsigned long long>(events.events()),
+                  static_cast<unsigned long long>(current.pending_jobs), static_cast<unsigned long long>(current.dropped_files), static_cast<unsigned long long>(current.rename_retries),
+                  fds);
+      std::fflush(stdout);
+      previous = current;
+    }
+    stop = true;
+    for (auto& t : threads) {
+      t.join();
+    }
+    all.merge(interval);
+    if (options.group_commit) {
+      ++probes;
+      probes_failed += probe_durable(*sink) ? 0 : 1;
+    }
+    sink->flush();
+    add_stats(stats, sink->stats());
+    sink.reset();  // waits for queued compressions
+  }
+  const bool failing = cfg.fail_renames > 0 || options.shutdown_policy == spdlog::sinks::compression_shutdown_policy::abandon;
+  if (failing) {
+#ifdef __linux__
+    rename_failure_percent = 0;
+#endif
+    options.shutdown_policy = spdlog::sinks::compression_shutdown_policy::drain;
+    open_sink().reset();  // archives what the failed renames and abandoned jobs left
+  }
+  long fds_after = open_fds();
+  std::printf("total   %llu records, %llu rotations, %llu archives (%.1f MB -> %.1f MB)  p50<%llu p99<%llu p99.9<%llu max=%llu ns  max fds=%ld\n",
+              static_cast<unsigned long long>(stats.records), static_cast<unsigned long long>(stats.rotations), static_cast<unsigned long long>(events.events()),
+              static_cast<double>(events.bytes_in()) / 1e6, static_cast<double>(events.bytes_out()) / 1e6, static_cast<unsigned long long>(all.quantile(0.5)),
+              static_cast<unsigned long long>(all.quantile(0.99)), static_cast<unsigned long long>(all.quantile(0.999)), static_cast<unsigned long long>(all.max()), max_fds);
+
+  bool ok = true;
+  ok &= check("events", (events.out_of_order() == 0 && events.skipped() <= stats.dropped_files) || failing,
+              fmt::format("{} archives, {} out of order, {} numbers skipped, {} files dropped", events.events(), events.out_of_order(), events.skipped(), stats.dropped_files));
+
+  std::string basename, ext;
+  std::tie(basename, ext) = spdlog::details::file_helper::split_by_extension(cfg.file);
+  std::string comp_ext = spdlog::details::policy_codec<spdlog::details::compression_codec>::make(cfg.options.codec)->extension();
+  spdlog::details::archive_index index(cfg.dir, basename, ext, comp_ext);
+  spdlog::details::sink_directory dir(cfg.dir);
+  index.scan(dir);
+  std::vector<std::size_t> archived, raw(index.raw().begin(), index.raw().end());
+  for (const auto& entry : index.entries()) {
+    archived.push_back(entry.first);
+  }
+  std::size_t gaps, duplicates, raw_gaps, raw_duplicates;
+  bool archives_ok = contiguous(archived, gaps, duplicates);
+  bool raw_ok = contiguous(raw, raw_gaps, raw_duplicates);
+  std::uint64_t highest = std::max<std::uint64_t>(archived.empty() ? 0 : *std::max_element(archived.begin(), archived.end()), raw.empty() ? 0 : raw.back());
+  std::uint64_t numbers = stats.rotations + events.events() + cfg.max_files;
+  ok &= check("files",
+              (archives_ok || cfg.ship || (duplicates == 0 && (failing || (sequence && gaps <= stats.dropped_files)))) && (raw_ok || (failing && raw_duplicates == 0)) &&
+                  highest <= numbers && archived.size() <= cfg.max_comp_files,
+              fmt::format("{} archives ({} gaps, {} duplicates), {} rotated files ({} gaps, {} duplicates), highest number {}", archived.size(), gaps, duplicates, raw.size(),
+                          raw_gaps, raw_duplicates, highest));
+  ok &= check("staged", index.staged().empty(),
+              fmt::format("{} files set aside and not archived, {} renames retried, {} given up", index.staged().size(), stats.rename_retries, stats.rename_failures));
+
+  std::size_t decoded = 0, undecodable = 0;
+  for (const auto& entry : index.entries()) {
+    bool whole = options.codec && options.codec->decode_file(index.path(entry.first, entry.second.tail), [](const char*, std::size_t) { return true; });
+    ++(whole ? decoded : undecodable);
+  }
+  if (decoded == 0 && undecodable > 0) {
+    check("decode", true, "the codec does not decode");
+  } else {
+    ok &= check("decode", undecodable == 0, fmt::format("{} archives decoded, {} failed, {} recompressed", decoded, undecodable, stats.recompressions));
+  }
+
+  if (streaming) {
+    check("bytes", true, "not checked in streaming mode");
+  } else {
+    std::uint64_t left = 0, size = 0;
+    for (auto number : raw) {
+      if (dir.stat(spdlog::sinks::compressed_rotating_file_sink_mt::calc_filename(cfg.dir + "/" + cfg.file, number), size)) {
+        left += size;
+      }
+    }
+    if (dir.stat(cfg.dir + "/" + cfg.file, size)) {
+      left += size;
+    }
+    std::uint64_t found = events.bytes_in() + stats.dropped_bytes + left;
+    ok &= check("bytes", found == stats.bytes_logged,
+                fmt::format("{} logged, {} archived + {} dropped + {} in rotated and active files", stats.bytes_logged, events.bytes_in(), stats.dropped_bytes, left));
+  }
+
+  if (options.group_commit) {
+    ok &= check("durable", probes_failed == 0, fmt::format("{} of {} probes synced", probes - probes_failed, probes));
+  }
+  ok &= check("fds", fds_after == fds_before, fmt::format("{} before the sink, {} after, {} at most", fds_before, fds_after, max_fds));
+  return ok ? 0 : 1;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  config cfg;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool value = i + 1 < argc;
+    if (arg == "--dir" && value) {
+      cfg.dir = argv[++i];
+    } else if (arg == "--file" && value) {
+      cfg.file = argv[++i];
+    } else if (arg == "--seconds" && value) {
+      cfg.seconds = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--report" && value) {
+      cfg.report = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    } else if (arg == "--threads" && value) {
+      cfg.threads = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    } else if (arg == "--max-size" && value) {
+      cfg.max_size = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--max-files" && value) {
+      cfg.max_files = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--max-comp-files" && value) {
+      cfg.max_comp_files = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--size" && value) {
+      cfg.size = argv[++i];
+    } else if (arg == "--queue" && value) {
+      cfg.options.compression_queue_size = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--pool" && value) {
+      cfg.options.compression_threads = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--restarts" && value) {
+      cfg.restarts = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--fail-renames" && value) {
+      cfg.fail_renames = static_cast<unsigned>(std::min<unsigned long long>(100, std::strtoull(argv[++i], nullptr, 10)));
+#ifndef __linux__
+      std::fprintf(stderr, "--fail-renames needs Linux\n");
+      return 2;
+#endif
+    } else if (arg == "--codec" && value) {
+      std::string codec = argv[++i];
+#ifdef COMPRESSED_SINK_USE_ZLIB
+      if (codec == "gzip") {
+        cfg.options.codec = std::make_shared<spdlog::details::gzip_codec>();
+      }
+      if (codec == "adaptive") {
+        cfg.options.codec = std::make_shared<spdlog::details::adaptive_codec>([](int level) { return std::make_shared<spdlog::details::gzip_codec>(level); }, 1, 9, 2, 0.5, 0);
+      }
+#endif
+#ifdef COMPRESSED_SINK_USE_ZSTD
+      if (codec == "zstd") {
+        cfg.options.codec = std::make_shared<spdlog::details::zstd_codec>();
+      }
+#endif
+#ifdef COMPRESSED_SINK_USE_LZ4
+      if (codec == "lz4") {
+        cfg.options.codec = std::make_shared<spdlog::details::lz4_codec>();
+      }
+#endif
+      if (!cfg.options.codec) {
+        std::fprintf(stderr, "codec %s is not compiled in\n", codec.c_str());
+        return 2;
+      }
+    } else if (arg == "--async") {
+      cfg.options.async_compression = true;
+    } else if (arg == "--sequence") {
+      cfg.options.naming = spdlog::sinks::archive_naming::sequence;
+    } else if (arg == "--streaming") {
+      cfg.options.streaming = true;
+    } else if (arg == "--group-commit") {
+      cfg.options.group_commit = true;
+    } else if (arg == "--ship") {
+      cfg.ship = true;
+    } else if (arg == "--abandon") {
+      cfg.options.shutdown_policy = spdlog::sinks::compression_shutdown_policy::abandon;
+    } else if (arg == "--preallocate") {
+      cfg.options.preallocate_files = true;
+    } else if (arg == "--binary") {
+      cfg.options.binary_records = true;
+    } else if (arg == "--discard") {
+      cfg.options.overflow_policy = spdlog::sinks::compression_overflow_policy::discard;
+    } else {
+      std::fprintf(stderr, "unknown argument %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  int result = run(cfg);
+  std::error_code ec;
+  std::filesystem::remove_all(cfg.dir, ec);
+  return result;
+}
@@ -0,0 +1,136 @@
+//
+// Renders logs written with compressed_rotating_sink_options::binary_records as text,
+// through a spdlog pattern. Reads the files given, or stdin for "-" or none; archives
+// go through their decompressor first:
+//   zcat logs/log.3.txt.*.gz | ./binary_log_decoder
+//   ./binary_log_decoder --pattern "[%H:%M:%S.%e] [%l] %v" logs/log.txt logs/log.1.txt
+// Records of the sharded sink are prefixed with their sequence number, as it writes
+// them in text mode. Bytes that are not records are skipped up to the next record and
+// counted; the exit status is 1 if there were any.
+//
+// Build from the repository root:
+//   g++ -std=c++11 -O2 -I. tools/BinaryLogDecoder.cpp -o binary_log_decoder -lspdlog -lfmt
+//
+#include <spdlog/details/log_msg.h>
+#include <spdlog/pattern_formatter.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "BinaryRecord.h"
+
+namespace {
+
+struct decoder {
+  spdlog::pattern_formatter formatter;
+  spdlog::memory_buf_t text;
+  std::string source_file;
+  std::string source_function;
+  unsigned long long records = 0;
+  unsigned long long skipped = 0;
+
+  explicit decoder(const std::string& pattern) : formatter(pattern) {}
+
+  void render(const spdlog::details::binary_record& record) {
+    spdlog::source_loc source;
+    if (record.source_file.size() > 0) {
+      source_file.assign(record.source_file.data(), record.source_file.size());
+      source_function.assign(record.source_function.data(), record.source_function.size());
+      source = spdlog::source_loc(source_file.c_str(), record.source_line, source_function.c_str());
+    }
+    spdlog::details::log_msg msg(record.time, source, record.logger_name, record.level, record.payload);
+    msg.thread_id = record.thread_id;
+    text.clear();
+    if (record.sequence != 0) {
+      fmt::format_to(std::back_inserter(text), "{:016x} ", record.sequence);
+    }
+    formatter.format(msg, text);
+    std::fwrite(text.data(), 1, text.size(), stdout);
+    ++records;
+  }
+
+  // decodes what it can of data, returns the bytes used
+  std::size_t decode(const char* data, std::size_t size, bool at_end) {
+    std::size_t used = 0;
+    spdlog::details::binary_record record;
+    while (used < size) {
+      std::ptrdiff_t n = spdlog::details::decode_binary_record(data + used, size - used, record);
+      if (n > 0) {
+        render(record);
+        used += static_cast<std::size_t>(n);
+      } else if (n == 0 && !at_end) {
+        break;  // the rest of the record is in the next read
+      } else {
+        ++skipped;  // not a record, or cut short at the end: look for the next one
+        ++used;
+      }
+    }
+    return used;
+  }
+
+  bool decode_file(std::FILE* in) {
+    std::vector<char> buf(1024 * 1024);
+    std::size_t filled = 0;
+    for (;;) {
+      if (filled == buf.size()) {
+        buf.resize(buf.size() * 2);  // a record larger than the buffer
+      }
+      std::size_t n = std::fread(buf.data() + filled, 1, buf.size() - filled, in);
+      filled += n;
+      bool at_end = n == 0;
+      std::size_t used = decode(buf.data(), filled, at_end);
+      std::memmove(buf.data(), buf.data() + used, filled - used);
+      filled -= used;
+      if (at_end) {
+        return std::ferror(in) == 0;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string pattern = "%+";
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--pattern" && i + 1 < argc) {
+      pattern = argv[++i];
+    } else if (arg == "--help" || arg == "-h") {
+      std::printf("usage: %s [--pattern PATTERN] [FILE|-]...\n", argv[0]);
+      return 0;
+    } else {
+      files.push_back(arg);
+    }
+  }
+  if (files.empty()) {
+    files.push_back("-");
+  }
+
+  decoder d(pattern);
+  bool ok = true;
+  for (const auto& file : files) {
+    std::FILE* in = file == "-" ? stdin : std::fopen(file.c_str(), "rb");
+    if (in == nullptr) {
+      std::fprintf(stderr, "can not open %s\n", file.c_str());
+      ok = false;
+      continue;
+    }
+    if (!d.decode_file(in)) {
+      std::fprintf(stderr, "failed reading %s\n", file.c_str());
+      ok = false;
+    }
+    if (in != stdin) {
+      std::fclose(in);
+    }
+  }
+  std::fflush(stdout);
+  if (d.skipped > 0) {
+    std::fprintf(stderr, "%llu records, %llu bytes skipped that were not records\n", d.records, d.skipped);
+  }
+  return ok && d.skipped == 0 ? 0 : 1;
+}